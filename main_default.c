@@ -1,17 +1,86 @@
 #include <LPC17xx.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
-#include <stdlib.h>
+#include <string.h>
 
 //Timeslice frequency Hz, CURRENTLY UNUSED
 const int timeslice_frequency = 1;
 
+//Milliseconds between timeslice pre-empts
+#define TIMESLICE_MS 2000
+
+//Set to 1 to stop the 1 ms tick while only the idle task can run, SysTick is reprogrammed to fire at the next wake-up
+#define TICKLESS_IDLE 0
+
+//Kernel capacity. Task and scheduler storage below is sized from these at compile time
+#define MAX_TASKS 8
+//Priorities are 0 (idle) to NUM_PRIORITIES-1, at most 32 so the ready bitmap fits one word
+#define NUM_PRIORITIES 6
+//Bytes of RAM that task stacks are carved from, see stack_region
+#define STACK_REGION_SIZE 0x2000
+//Stack bytes for task_create calls that pass 0, and for the idle task which takes over main()'s stack
+#define DEFAULT_STACK_SIZE 0x400
+#define IDLE_STACK_SIZE 0x400
+//Bytes of the heap used by heap_malloc/heap_free
+#define HEAP_SIZE 0x1000
+//Smallest stack accepted, room for the initial register frame plus a little working space
+#define MIN_STACK_SIZE 0x100
+
+//Unused stack words hold this pattern, so the deepest word a task has touched can be found later
+#define STACK_FILL_PATTERN 0xA5A5A5A5
+//Set to 1 for the idle task to check every STACK_CHECK_PERIOD_MS for tasks with less than STACK_WARN_BYTES never used
+#define STACK_CHECK 0
+#define STACK_CHECK_PERIOD_MS 1000
+#define STACK_WARN_BYTES 0x40
+
+#if NUM_PRIORITIES > 32
+#error "NUM_PRIORITIES must fit in the 32 bit ready bitmap"
+#endif
+#if MAX_TASKS > 99
+#error "MAX_TASKS must stay below 99, which marks no task"
+#endif
+
+//Set to 1 to print task status and priority lists on every PendSV. Walks every task and priority, so leave off in production
+#define PENDSV_TRACE 0
+
+//Set to 1 for the demo to protect its shared resource with a priority ceiling mutex instead of an inheritance one
+#define USE_CEILING_MUTEX 0
+
+//Set to 1 to time kernel paths with the DWT cycle counter, results are printed by benchmark_report() in the idle task.
+//Benchmark tasks then run instead of the demo tasks
+#define RTOS_BENCHMARK 0
+//Messages the queue benchmark passes, half through queue_send and half through queue_reserve/queue_commit
+#define QUEUE_BENCH_MESSAGES 10000
+//Wake-ups the signal and notify comparison times through each path
+#define WAKE_BENCH_ROUNDS 1000
+//Rounds of the mutex contention benchmark, run once with each USE_CEILING_MUTEX setting to compare the two
+#define MUTEX_BENCH_ROUNDS 1000
+
+//Kernel critical sections mask interrupts with this priority value or higher (less urgent) through BASEPRI.
+//Interrupts with a lower value are never delayed by the kernel, so they must not call it; handlers using the
+//_from_isr calls need a value of at least this. LPC17xx has 32 levels, 0 most urgent, PendSV is put on the last
+#define KERNEL_INTERRUPT_PRIORITY 8
+
+#if KERNEL_INTERRUPT_PRIORITY < 1 || KERNEL_INTERRUPT_PRIORITY >= (1 << __NVIC_PRIO_BITS)
+#error "KERNEL_INTERRUPT_PRIORITY must be between 1 and the lowest NVIC priority, BASEPRI 0 masks nothing"
+#endif
+
 // Define task status macros
 typedef uint8_t task_status;
 #define task_ready							1
 #define task_blocked						0
 #define task_blocked_semaphore	2//Need this to tell scheduler to disregard variables which keep track of how long delay is
+#define task_blocked_mutex			3//Waiting in a mutex's wait list, made ready by mutex_release handing it the mutex
+#define task_blocked_queue			4//Waiting to send to or receive from a message queue
+#define task_blocked_event			5//Waiting for flags of an event group
+#define task_blocked_notify			6//Waiting in notify_wait for a notification to itself
+
+// Results of blocking calls, and timeout that never expires
+#define rtos_ok									0
+#define rtos_timeout						1
+#define wait_forever						0xFFFFFFFF
 
 //Function declarations
 uint32_t storeContext(void);
@@ -19,37 +88,187 @@ void restoreContext(uint32_t sp);
 uint8_t find_next_task();
 uint8_t remove_front_node(uint8_t priority);
 void add_node(uint8_t priority_, uint8_t taskNum);
+void make_ready(uint8_t taskNum);
+struct Node_t *unlink_node(uint8_t priority, uint8_t taskNum);
+void add_node_front(uint8_t priority, struct Node_t *node);
+void set_priority(uint8_t taskNum, uint8_t priority);
+void wait_list_insert(struct Node_t **head, uint8_t taskNum);
+bool wait_list_remove(struct Node_t **head, uint8_t taskNum);
+bool higher_priority_ready(void);
+void delay_list_insert(uint8_t taskNum, uint32_t ticks);
+void delay_list_remove(uint8_t taskNum);
 
-// Node data structure
+// Node data structure, embedded in each task's TCB so queueing never allocates.
+// A task is in at most one ready or wait list at a time, so one node per task is enough
 typedef struct Node_t{
 	uint8_t task_num;
 	struct Node_t *next;
 }Node_t;
 
-// System clock and pre-empt
+// System clock, counts 1 ms SysTick interrupts
 uint32_t msTicks = 0;
-void SysTick_Handler(void) {
-	// When context switch required
-	if (!(msTicks % 2000)) {
-		// Write 1 to PENDSVSET bit of ICSR
-		SCB->ICSR |= (1 << 28);
-	}
-	msTicks++;
+
+#if RTOS_BENCHMARK
+//Cycle statistics of one measured kernel path
+typedef struct{
+	uint32_t samples;
+	uint32_t total_cycles;
+	uint32_t max_cycles;
+}benchmark_t;
+
+//Cycles spent choosing the next task in PendSV_Handler
+benchmark_t bench_schedule;
+//Cycles spent advancing the delay list in SysTick_Handler
+benchmark_t bench_delay;
+//Cycles from mutex_release handing a mutex to a waiter until that waiter runs again, sampled each round the
+//contention benchmark's high task has to wait for low
+benchmark_t bench_mutex_handoff;
+uint32_t mutex_handoff_start;
+//Cycles a task spent blocked in mutex_acquire, max is the worst case blocking time
+benchmark_t bench_mutex_blocked;
+//Context switches done by PendSV_Handler
+uint32_t context_switches;
+//Context switches during the mutex contention benchmark, valid once mutex_bench_done
+uint32_t mutex_bench_switches;
+bool mutex_bench_done;
+//Cycles the queue benchmark consumer took to receive QUEUE_BENCH_MESSAGES, 0 until it is done
+uint32_t queue_bench_cycles;
+//Cycles each kernel service keeps interrupts masked, max is its worst case added interrupt latency
+benchmark_t bench_mask_mutex_acquire;
+benchmark_t bench_mask_mutex_release;
+benchmark_t bench_mask_wait;
+benchmark_t bench_mask_signal;
+benchmark_t bench_mask_isr;
+benchmark_t bench_mask_queue;
+benchmark_t bench_mask_pool;
+benchmark_t bench_mask_event;
+benchmark_t bench_mask_notify;
+//Cycles from signal or notify readying a waiting task until that task runs again, to compare the two
+benchmark_t bench_signal_wake;
+uint32_t signal_wake_start;
+benchmark_t bench_notify_wake;
+uint32_t notify_wake_start;
+//Cycles per heap_malloc and heap_free call, from heap_benchmark
+benchmark_t bench_heap_malloc;
+benchmark_t bench_heap_free;
+benchmark_t bench_mask_delay;
+benchmark_t bench_mask_tick;
+benchmark_t bench_mask_pendsv;
+
+void benchmark_init(void) {
+	//Enable trace so the DWT cycle counter runs
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CYCCNT = 0;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+}
+
+//Records cycles elapsed since start, start is a DWT->CYCCNT value taken before the measured path
+void benchmark_record(benchmark_t *b, uint32_t start) {
+	uint32_t cycles = DWT->CYCCNT - start;
+	(*b).samples++;
+	(*b).total_cycles += cycles;
+	if (cycles > (*b).max_cycles)
+		(*b).max_cycles = cycles;
+}
+
+void benchmark_print(const char *name, benchmark_t *b) {
+	if ((*b).samples == 0)
+		return;
+	printf("BENCHMARK %s: %d samples, %d avg cycles, %d max cycles\n", name, (*b).samples, (*b).total_cycles / (*b).samples, (*b).max_cycles);
+}
+
+void benchmark_report(void) {
+	benchmark_print("schedule decision", &bench_schedule);
+	benchmark_print("delay list tick", &bench_delay);
+	benchmark_print("mutex handoff", &bench_mutex_handoff);
+	benchmark_print("mutex blocked", &bench_mutex_blocked);
+	benchmark_print("masked in mutex_acquire", &bench_mask_mutex_acquire);
+	benchmark_print("masked in mutex_release", &bench_mask_mutex_release);
+	benchmark_print("masked in wait", &bench_mask_wait);
+	benchmark_print("masked in signal", &bench_mask_signal);
+	benchmark_print("masked in _from_isr calls", &bench_mask_isr);
+	benchmark_print("masked in queue calls", &bench_mask_queue);
+	benchmark_print("masked in pool calls", &bench_mask_pool);
+	benchmark_print("masked in event calls", &bench_mask_event);
+	benchmark_print("masked in notify calls", &bench_mask_notify);
+	benchmark_print("signal to waiter running", &bench_signal_wake);
+	benchmark_print("notify to waiter running", &bench_notify_wake);
+	benchmark_print("heap malloc", &bench_heap_malloc);
+	benchmark_print("heap free", &bench_heap_free);
+	benchmark_print("masked in rtosDelay", &bench_mask_delay);
+	benchmark_print("masked in SysTick_Handler", &bench_mask_tick);
+	benchmark_print("masked in PendSV_Handler", &bench_mask_pendsv);
+	printf("BENCHMARK context switches: %d\n", context_switches);
+	//Compare between a build with USE_CEILING_MUTEX 0 and one with 1. Max blocked is 0 when high never had to wait
+	if (mutex_bench_done)
+		printf("BENCHMARK mutex contention (%s): %d rounds, %d context switches, %d max blocked cycles, %d max handoff cycles\n",
+			USE_CEILING_MUTEX ? "ceiling" : "inheritance", MUTEX_BENCH_ROUNDS, mutex_bench_switches, bench_mutex_blocked.max_cycles,
+			bench_mutex_handoff.max_cycles);
+	//Messages per second from queue_bench_producer to queue_bench_consumer
+	if (queue_bench_cycles != 0)
+		printf("BENCHMARK queue throughput: %d messages in %d cycles, %d messages/s\n", QUEUE_BENCH_MESSAGES, queue_bench_cycles,
+			(uint32_t)((uint64_t)QUEUE_BENCH_MESSAGES * SystemCoreClock / queue_bench_cycles));
 }
+#endif
+
+//Value written to BASEPRI by kernel critical sections, priority sits in the top __NVIC_PRIO_BITS bits
+#define kernel_basepri (KERNEL_INTERRUPT_PRIORITY << (8 - __NVIC_PRIO_BITS))
+
+//Kernel critical section for interrupt handlers, tasks use enter_critical/exit_critical. Unlock takes the
+//benchmark_t of the service, so with RTOS_BENCHMARK each service's longest masking time is recorded. Sections
+//cannot overlap, masking stops every other kernel caller, so one start time is enough
+#if RTOS_BENCHMARK
+uint32_t mask_start;
+#define kernel_lock()										do { __set_BASEPRI(kernel_basepri); mask_start = DWT->CYCCNT; } while (0)
+#define kernel_restore(b, basepri)			do { benchmark_record(&(b), mask_start); __set_BASEPRI(basepri); } while (0)
+#else
+#define kernel_lock()										__set_BASEPRI(kernel_basepri)
+#define kernel_restore(b, basepri)			__set_BASEPRI(basepri)
+#endif
+#define kernel_unlock(b)								kernel_restore(b, 0)
+
+#if TICKLESS_IDLE
+//SysTick interrupts actually taken, compare with msTicks to see how many ticks tickless idle suppressed
+uint32_t systick_interrupts = 0;
+#endif
 
 // Semaphore struct
 typedef struct{
 	uint32_t count;
-	//Wait list
+	//Wait list, highest priority first when priority_ordered, otherwise first come first served
 	Node_t *head;
 	bool block_current_task_next_preempt;
+	bool priority_ordered;
+	//Last waiter of each priority in the wait list and a bit per priority that has one, so a waiter is linked in
+	//behind its own priority in O(1). A FIFO semaphore keeps all its waiters under priority 0
+	uint32_t wait_bitmap;
+	Node_t *wait_tail[NUM_PRIORITIES];
 }sem_t;
 
+// Define mutex type macros
+#define mutex_inherit						0//Owner inherits priority of higher priority tasks blocked on it
+#define mutex_ceiling						1//Owner runs at the mutex's ceiling priority from the moment it acquires
+
+//Bit set in task_owner while the wait list is not empty
+#define mutex_waiters						(1u << 31)
+#define mutex_owner(s)					((uint8_t)((*(s)).task_owner & 0xFF))
+
 //Mutex struct
-typedef struct{
-	bool available;
-	//Owner (acquirer) of mutex, is 99 if not acquired
-	uint8_t task_owner;
+typedef struct mutex_t{
+	uint8_t type;
+	//Priority owner is raised to on acquire, only used by mutex_ceiling
+	uint8_t ceiling;
+	//Owner (acquirer) of mutex, is 99 if not acquired. Or'd with mutex_waiters while tasks are blocked on it, which
+	//forces the owner's release through the kernel. Claimed and freed with LDREX/STREX when uncontended
+	volatile uint32_t task_owner;
+	//Recursive mutexes can be re-acquired by their owner, depth counts acquires not yet released. Only the owner
+	//touches depth, so it needs no locking
+	bool recursive;
+	uint32_t depth;
+	//Tasks blocked on the mutex, highest priority first
+	Node_t *head;
+	//Next mutex held by the same owner
+	struct mutex_t *next_held;
 }mutex_t;
 
 mutex_t mutex_lock;
@@ -58,28 +277,68 @@ mutex_t mutex_lock;
 typedef struct{
 	//Bottom of task stack (highest address)
   uint32_t *base;
+	//Lowest word of task stack, and stack size in bytes
+	uint32_t *stack_limit;
+	uint32_t stack_size;
+	//Deepest stack word found in use so far, only moves down so each measurement resumes where the last stopped
+	uint32_t *stack_low_water;
 	//Temp pointer
 	uint32_t *current;
 	//Top of stack, could also be on top of pushed registers (lowest address)
 	uint32_t *stack_pointer;
 	
+	//Effective priority, raised above base_priority while a mutex this task owns is wanted by a higher priority task
 	uint8_t priority;
+	uint8_t base_priority;
 	task_status status;
 	
-	//Total number of timeslices to be blocked, >1 if rtosDelay called, 1 if rtosYield or rtosDelay(0) is called
-	uint32_t timeslices_to_be_blocked;
-	//Timeslices that have been blocked so far. Incremented in PendSV_Handler, and if >timeslices_to_be_blocked, task is blocked->activated
-	uint32_t timeslices_since_blocked;
+	//Mutexes this task owns, used to work out its inherited priority
+	mutex_t *held_mutexes;
+	//Mutex this task is waiting for while task_blocked_mutex, so inheritance can follow the chain of owners
+	mutex_t *blocked_on_mutex;
+	
+	//Ticks left after the previous task in the delay list runs out, only valid while task is in the delay list
+	uint32_t delay_delta;
+	//Next and previous task in the delay list, 99 if none
+	uint8_t delay_next;
+	uint8_t delay_prev;
+	//In the delay list, either from rtosDelay or as the timeout of a blocking call
+	bool delayed;
+	
+	//Semaphore this task is waiting for while task_blocked_semaphore, so a timeout can take it off the wait list
+	sem_t *blocked_on_sem;
+	//Priority this task was queued under in that semaphore's wait list
+	uint8_t sem_band;
+	//Whether the last blocking call was satisfied (rtos_ok) or timed out (rtos_timeout)
+	uint8_t wait_result;
+	//Queue wait list this task is in while task_blocked_queue, and the item to copy to or from. For a waiting
+	//queue_reserve the item is NULL until it is given its slot
+	//Event groups use the same wait list pointer
+	struct Node_t **blocked_on_list;
+	void *queue_item;
+	//Event flags waited for with their event_wait options, and the flags that satisfied the wait
+	uint32_t event_mask;
+	uint8_t event_options;
+	uint32_t event_flags;
+	//Notification value updated by notify, and whether a notification came since the last notify_wait
+	uint32_t notify_value;
+	bool notify_pending;
 	
-	sem_t *when_unblocked_decrease_semaphore;
+	//Depth of enter_critical calls this task is inside, and the BASEPRI to go back to when it leaves the outermost
+	uint32_t critical_nesting;
+	uint32_t critical_basepri;
 	
-	//Temporary priority promotion flag, if task inherits priority to release mutex needed by higher priority task
-	bool temporary_promotion;
-	bool add_in_different_priority;
-	uint8_t different_priority;
+	//Link used by whichever ready list or wait list the task is currently in
+	Node_t node;
 }tcb_t;
 
-tcb_t TCBS[6];
+tcb_t TCBS[MAX_TASKS];
+
+//Task stacks are carved from this region, top down, as tasks are created. It is zero initialised in its own
+//section so the scatter file can give it a dedicated execution region, e.g. RW_STACKS +0 { *(task_stacks) }
+uint32_t stack_region[STACK_REGION_SIZE/4] __attribute__((section("task_stacks"), zero_init, aligned(8)));
+//Words of stack region not yet given to a task
+uint32_t stack_region_free = STACK_REGION_SIZE/4;
 //Created tasks is number of total tasks
 uint8_t createdTasks;
 //Numtasks is number of active tasks
@@ -87,267 +346,1633 @@ uint8_t numTasks;
 uint8_t currTask;
 uint8_t next_task;
 
-Node_t *schedule_array[6];
+//First task of the delay list, 99 if no task is delayed. Tasks are ordered by wake-up time and each stores its
+//delay relative to the one before it, so a tick only has to look at the front of the list
+uint8_t delay_head;
+
+Node_t *schedule_array[NUM_PRIORITIES];
+//Last node of each priority list, so tasks are appended without walking the list
+Node_t *schedule_tail[NUM_PRIORITIES];
+//Bit n set when schedule_array[n] is not empty, kept in sync by add_node and remove_front_node
+uint32_t ready_bitmap;
+
+//Task level critical section, masks kernel interrupts up to KERNEL_INTERRUPT_PRIORITY. Calls nest, only the
+//outermost exit_critical puts back the BASEPRI the task had before, so kernel services can be called inside one.
+//PendSV is masked too, so a task must not block inside a critical section it opened itself.
+//Interrupt handlers use kernel_lock/kernel_restore, the nesting count belongs to the task they interrupted
+void enter_critical(void)
+{
+	uint32_t basepri = __get_BASEPRI();
+	__set_BASEPRI(kernel_basepri);
+	if (TCBS[currTask].critical_nesting++ == 0)
+	{
+		TCBS[currTask].critical_basepri = basepri;
+#if RTOS_BENCHMARK
+		mask_start = DWT->CYCCNT;
+#endif
+	}
+}
+
+void exit_critical(void)
+{
+	if (--TCBS[currTask].critical_nesting == 0)
+		__set_BASEPRI(TCBS[currTask].critical_basepri);
+}
+
+//Kernel services leave their critical section through this, so the masking time of the outermost one is recorded
+#if RTOS_BENCHMARK
+void exit_critical_record(benchmark_t *b)
+{
+	if (TCBS[currTask].critical_nesting == 1)
+		benchmark_record(b, mask_start);
+	exit_critical();
+}
+#define kernel_exit(b)									exit_critical_record(&(b))
+#else
+#define kernel_exit(b)									exit_critical()
+#endif
+
+//Depth of scheduler_suspend calls. While above 0 the running task is not switched out, interrupts still run
+uint32_t scheduler_lock_count;
+//PendSV came while the scheduler was suspended, scheduler_resume requests it again
+bool switch_deferred;
+
+//Stops other tasks from running without masking any interrupt. Calls nest, only the outermost scheduler_resume
+//lets switches happen again. Only the running task changes the count, so no critical section is needed.
+//Task must not block while the scheduler is suspended
+void scheduler_suspend(void)
+{
+	scheduler_lock_count++;
+}
+
+void scheduler_resume(void)
+{
+	enter_critical();
+	if (--scheduler_lock_count == 0 && switch_deferred)
+	{
+		//Every switch requested meanwhile collapses into this one
+		switch_deferred = false;
+		SCB->ICSR |= (1 << 28);
+	}
+	exit_critical();
+}
 
 void mutex_init(mutex_t *s, uint32_t count_) {
-	(*s).available = true;
+	(*s).type = mutex_inherit;
+	(*s).ceiling = 0;
 	(*s).task_owner = 99;
+	(*s).recursive = false;
+	(*s).depth = 0;
+	(*s).head = NULL;
+	(*s).next_held = NULL;
 }
-void mutex_acquire(mutex_t *s) {
-	__disable_irq();
+
+//Priority ceiling mutex. Ceiling must be at least the priority of every task that uses the mutex, then no task
+//that could want it can pre-empt the owner, so acquire and release normally cause no context switch at all.
+//Returns false, leaving an inheritance mutex, if ceiling is not a priority with a ready list
+bool mutex_init_ceiling(mutex_t *s, uint8_t ceiling) {
+	mutex_init(s, 1);
+	if (ceiling >= NUM_PRIORITIES)
+		return false;
+	(*s).type = mutex_ceiling;
+	(*s).ceiling = ceiling;
+	return true;
+}
+
+//Inheritance mutex that its owner may acquire again, each acquire must be matched by a release
+void mutex_init_recursive(mutex_t *s) {
+	mutex_init(s, 1);
+	(*s).recursive = true;
+}
+
+//Adds mutex to front of the owner's held list
+void held_list_add(uint8_t taskNum, mutex_t *s)
+{
+	(*s).next_held = TCBS[taskNum].held_mutexes;
+	TCBS[taskNum].held_mutexes = s;
+}
+
+//Removes mutex from the owner's held list, mutexes are usually released newest first so this is normally the front
+void held_list_remove(uint8_t taskNum, mutex_t *s)
+{
+	mutex_t **link = &TCBS[taskNum].held_mutexes;
+	while (*link != NULL && *link != s)
+		link = &(**link).next_held;
+	if (*link != NULL)
+		*link = (*s).next_held;
+	(*s).next_held = NULL;
+}
+
+//Works out task's priority from scratch: its own base priority, raised to the ceiling or highest waiter of any
+//mutex it still holds. Wait lists are highest priority first, so each mutex only needs its head checked
+void update_inherited_priority(uint8_t taskNum)
+{
+	uint8_t priority = TCBS[taskNum].base_priority;
+	for (mutex_t *held = TCBS[taskNum].held_mutexes; held != NULL; held = (*held).next_held)
+	{
+		if ((*held).type == mutex_ceiling && (*held).ceiling > priority)
+			priority = (*held).ceiling;
+		if ((*held).head != NULL && TCBS[(*(*held).head).task_num].priority > priority)
+			priority = TCBS[(*(*held).head).task_num].priority;
+	}
+	set_priority(taskNum, priority);
+}
+
+//Passes priority down the chain of owners starting at mutex s. If an owner is itself blocked on another mutex,
+//that mutex's owner is raised too, and so on, so the whole chain runs at the blocked task's priority
+void inherit_priority(mutex_t *s, uint8_t priority)
+{
+	while (s != NULL)
+	{
+		uint8_t owner = mutex_owner(s);
+		if (TCBS[owner].priority >= priority)
+			return;
+		set_priority(owner, priority);
+		
+		if (TCBS[owner].status != task_blocked_mutex)
+			return;
+		//Owner's place in the next wait list depends on its priority, so re-sort it before moving on
+		s = TCBS[owner].blocked_on_mutex;
+		wait_list_remove(&(*s).head, owner);
+		wait_list_insert(&(*s).head, owner);
+	}
+}
+
+//A waiter left mutex s without getting it, so its owner, and any owner it waits on in turn, may no longer need the
+//priority that waiter passed on
+void mutex_waiter_left(mutex_t *s)
+{
+	//Nobody waiting any more, owner's release can go back to the fast path
+	if ((*s).head == NULL)
+	{
+		if ((*s).type != mutex_ceiling)
+			held_list_remove(mutex_owner(s), s);
+		(*s).task_owner &= ~mutex_waiters;
+	}
 	
-	while(!((*s).available)) {
-		//Check if mutex is owned (acquired) by owner of lower priority
-		if (TCBS[(*s).task_owner].priority < TCBS[currTask].priority)
+	//Stops once an owner's priority is unchanged, nothing further along can change either. Capped at MAX_TASKS
+	//hops so a deadlock cycle of owners waiting on each other cannot keep SysTick_Handler here forever
+	for (int hops = 0; s != NULL && hops < MAX_TASKS; hops++)
+	{
+		uint8_t owner = mutex_owner(s);
+		uint8_t old_priority = TCBS[owner].priority;
+		update_inherited_priority(owner);
+		
+		if (TCBS[owner].priority == old_priority || TCBS[owner].status != task_blocked_mutex)
+			return;
+		s = TCBS[owner].blocked_on_mutex;
+		wait_list_remove(&(*s).head, owner);
+		wait_list_insert(&(*s).head, owner);
+	}
+}
+
+//Uncontended acquire, claims a free inheritance mutex with one exclusive load/store pair and no interrupt masking.
+//Any exception between LDREX and STREX clears the exclusive monitor, so the store fails and the claim is retried.
+//The held list is only needed once someone waits, so the first waiter adds the mutex to it
+bool mutex_fast_acquire(mutex_t *s)
+{
+	if ((*s).type != mutex_inherit)
+		return false;
+	do
+	{
+		if (__LDREXW(&(*s).task_owner) != 99)
 		{
-			printf("I AM EXPLICITY INVOKING PENDSV HANDLER BECAUSE I HAVE TEMPORARILY PROMOTED LOWER PRIORITY TASK <%d> TO HIGHER PRIORITY OF CURRENT TASK <%d>====================================", (*s).task_owner, currTask);
-			TCBS[(*s).task_owner].different_priority = TCBS[(*s).task_owner].priority;
-			
-			//Find lower priority owner
-			Node_t *target = NULL;
-			//Case 1, only 1 item at beginning
-			if (((*schedule_array[TCBS[(*s).task_owner].priority]).task_num == (*s).task_owner) && ((*schedule_array[TCBS[(*s).task_owner].priority]).next == NULL))
-			{
-				printf("case 1\n");
-				target = schedule_array[TCBS[(*s).task_owner].priority];
-				schedule_array[TCBS[(*s).task_owner].priority] = NULL;
-			}
-			else if (((*schedule_array[TCBS[(*s).task_owner].priority]).task_num == (*s).task_owner) && ((*schedule_array[TCBS[(*s).task_owner].priority]).next != NULL))//Case 2, target at beginning but not alone
-			{
-				printf("case 2\n");
-				target = schedule_array[TCBS[(*s).task_owner].priority];
-				Node_t *afterTarget = (*schedule_array[TCBS[(*s).task_owner].priority]).next;
-				schedule_array[TCBS[(*s).task_owner].priority] = afterTarget;
-				
-			}
-			else//if not only one item
-			{
-				printf("case 3.");
-				target = (*schedule_array[TCBS[(*s).task_owner].priority]).next;
-				Node_t *beforeTarget = schedule_array[TCBS[(*s).task_owner].priority];
-
-				while ((*target).task_num != (*s).task_owner)
-				{
-					target = (*target).next;
-					beforeTarget = (*beforeTarget).next;
-				}
-				if ((*target).next == NULL)//If target is at end of linked list
-				{
-					printf("1\n");
-					(*beforeTarget).next = NULL;
-				}
-				else//If target not at end of linked list
-				{
-					printf("2\n");
-					Node_t *afterTarget = (*target).next;
-					(*beforeTarget).next = afterTarget;
-				}
-			}
-			if (schedule_array[TCBS[currTask].priority] == NULL)//Case 1, empty list, won't happen
-			{
-				schedule_array[TCBS[currTask].priority] = target;
-				(*target).next = NULL;
-			}
-			else
-			{
-				Node_t *afterTarget = schedule_array[TCBS[currTask].priority];
-				schedule_array[TCBS[currTask].priority] = target;
-				(*target).next = afterTarget;
-			}
-				
-			//Set new priority and promotion flag
-			TCBS[(*s).task_owner].temporary_promotion = true;
-			TCBS[(*s).task_owner].priority = TCBS[currTask].priority;
+			__CLREX();
+			return false;
 		}
-		
-		__enable_irq();
-		printf("I am waiting for the mutex to be released by the owner. Thus I am enabling and disabling IRQs\n");
-		printf("Current value of mutex count is <%d>\n", (*s).available);
-		__disable_irq();
+	} while (__STREXW(currTask, &(*s).task_owner) != 0);
+	__DMB();
+	return true;
+}
+
+//Uncontended release, frees the mutex only if current task owns it and nobody is waiting
+bool mutex_fast_release(mutex_t *s)
+{
+	if ((*s).type != mutex_inherit)
+		return false;
+	__DMB();
+	do
+	{
+		if (__LDREXW(&(*s).task_owner) != currTask)
+		{
+			__CLREX();
+			return false;
+		}
+	} while (__STREXW(99, &(*s).task_owner) != 0);
+	return true;
+}
+
+//Acquires mutex, waiting at most ticks for it (wait_forever to never give up, 0 to only try).
+//Returns rtos_ok once current task owns the mutex, rtos_timeout if it did not get it in time
+uint8_t mutex_acquire_timeout(mutex_t *s, uint32_t ticks) {
+	//Owner re-acquiring a recursive mutex only counts it. Only the owner can change task_owner away from itself,
+	//so this check needs no lock
+	if ((*s).recursive && mutex_owner(s) == currTask)
+	{
+		(*s).depth++;
+		return rtos_ok;
+	}
+	
+	if (mutex_fast_acquire(s))
+	{
+		(*s).depth = 1;
+		return rtos_ok;
+	}
+	
+	enter_critical();
+	
+	//Freed between the fast path and here, or a ceiling mutex which always comes through the kernel
+	if ((*s).task_owner == 99)
+	{
+		(*s).task_owner = currTask;
+		(*s).depth = 1;
+		//Ceiling is applied straight away. Current task is running so this is only a field change, no switch
+		if ((*s).type == mutex_ceiling)
+		{
+			held_list_add(currTask, s);
+			if ((*s).ceiling > TCBS[currTask].priority)
+				TCBS[currTask].priority = (*s).ceiling;
+		}
+		kernel_exit(bench_mask_mutex_acquire);
+		printf("=================================THE MUTEX IS NOW <UNAVAILABLE> WITH OWNER TASK <%d>=======================================\n", currTask);
+		return rtos_ok;
+	}
+	
+	if (ticks == 0)
+	{
+		kernel_exit(bench_mask_mutex_acquire);
+		return rtos_timeout;
+	}
+	
+	//First waiter. Owner may have taken the mutex on the fast path, so put it in its held list now, and mark it
+	//so the owner's release comes through the kernel to hand it over
+	if (!((*s).task_owner & mutex_waiters))
+	{
+		if ((*s).type != mutex_ceiling)
+			held_list_add(mutex_owner(s), s);
+		(*s).task_owner |= mutex_waiters;
 	}
 	
-	(*s).task_owner = currTask;
-	(*s).available = false;
+	//Blocks current task in the mutex's wait list instead of spinning, mutex_release hands the mutex over
+	wait_list_insert(&(*s).head, currTask);
+	TCBS[currTask].status = task_blocked_mutex;
+	TCBS[currTask].blocked_on_mutex = s;
+	//Also in the delay list, whichever of mutex_release or the timeout comes first takes it off the other
+	if (ticks != wait_forever)
+		delay_list_insert(currTask, ticks);
+	
+	//If mutex is owned (acquired) by owner of lower priority, it and any owner it is waiting on inherit current
+	//task's priority so medium priority tasks cannot keep them from releasing. A ceiling mutex only gets here if
+	//its owner blocked while holding it or the ceiling is too low, and falls back on the same inheritance
+	inherit_priority(s, TCBS[currTask].priority);
+#if RTOS_BENCHMARK
+	uint32_t blocked_start = DWT->CYCCNT;
+#endif
+	SCB->ICSR |= (1 << 28);
+	kernel_exit(bench_mask_mutex_acquire);
+	
+	//Runs again once mutex_release has made this task the owner, or the timeout ran out
+	if (TCBS[currTask].wait_result != rtos_ok)
+		return rtos_timeout;
+#if RTOS_BENCHMARK
+	benchmark_record(&bench_mutex_handoff, mutex_handoff_start);
+	benchmark_record(&bench_mutex_blocked, blocked_start);
+#endif
 	printf("=================================THE MUTEX IS NOW <UNAVAILABLE> WITH OWNER TASK <%d>=======================================\n", currTask);
-	__enable_irq();
+	return rtos_ok;
+}
+
+void mutex_acquire(mutex_t *s) {
+	mutex_acquire_timeout(s, wait_forever);
 }
 	
 void mutex_release(mutex_t *s) {
-	if (currTask == (*s).task_owner)
+	//Inner release of a recursive mutex, owner still holds it
+	if ((*s).recursive && mutex_owner(s) == currTask && (*s).depth > 1)
 	{
-		__disable_irq();
-		(*s).task_owner = 99;
-		(*s).available = true;
-		printf("=================================THE MUTEX IS NOW <AVAILABLE>=======================================\n");
-		if (TCBS[currTask].temporary_promotion)
+		(*s).depth--;
+		return;
+	}
+	
+	if (mutex_fast_release(s))
+	{
+		return;
+	}
+	
+	if (currTask == mutex_owner(s))
+	{
+		enter_critical();
+		
+		held_list_remove(currTask, s);
+		
+		if ((*s).head == NULL)
 		{
-			TCBS[currTask].temporary_promotion = false;
-			TCBS[currTask].add_in_different_priority = true;
-			__enable_irq();
-			printf("I AM EXPLICITY INVOKING PENDSV HANDLER BECAUSE I AM DONE BEING TEMPORARILY PROMOTED\n");
-			SCB->ICSR |= (1 << 28);
+			(*s).task_owner = 99;
+		}
+		else
+		{
+			//Hands mutex straight to highest priority waiter, so no other task can take it in between
+			uint8_t waiter = (*((*s).head)).task_num;
+			(*s).head = (*((*s).head)).next;
+			//Held list entry is kept while more tasks wait, or for a ceiling mutex
+			if ((*s).head != NULL || (*s).type == mutex_ceiling)
+				held_list_add(waiter, s);
+			(*s).task_owner = ((*s).head != NULL) ? (waiter | mutex_waiters) : waiter;
+			(*s).depth = 1;
+			delay_list_remove(waiter);
+			TCBS[waiter].wait_result = rtos_ok;
+			TCBS[waiter].blocked_on_mutex = NULL;
+			make_ready(waiter);
+			//New owner inherits from whoever is still waiting
+			update_inherited_priority(waiter);
+#if RTOS_BENCHMARK
+			mutex_handoff_start = DWT->CYCCNT;
+#endif
 		}
+		
+		//Done being promoted for this mutex, but keeps any priority still inherited through other mutexes it holds.
+		//Current task is running so only its priority field changes
+		update_inherited_priority(currTask);
+		
+		//One context switch at most, and only if new owner or anyone else now outranks current task
+		if (higher_priority_ready())
+			SCB->ICSR |= (1 << 28);
+		kernel_exit(bench_mask_mutex_release);
+		printf("=================================THE MUTEX IS NOW <AVAILABLE>=======================================\n");
+	}
+	else
+	{
+		printf("=================================YOU ARE NOT THE OWNER!!!!!!!!!!!!!!!!!!!!!!!!!=======================================\n");
+		printf("=================================YOU ARE NOT THE OWNER!!!!!!!!!!!!!!!!!!!!!!!!!=======================================\n");
+		printf("=================================YOU ARE NOT THE OWNER!!!!!!!!!!!!!!!!!!!!!!!!!=======================================\n");
+		printf("=================================YOU ARE NOT THE OWNER!!!!!!!!!!!!!!!!!!!!!!!!!=======================================\n");
+		printf("=================================YOU ARE NOT THE OWNER!!!!!!!!!!!!!!!!!!!!!!!!!=======================================\n");
+		printf("=================================YOU ARE NOT THE OWNER!!!!!!!!!!!!!!!!!!!!!!!!!=======================================\n");
+		printf("=================================YOU ARE NOT THE OWNER!!!!!!!!!!!!!!!!!!!!!!!!!=======================================\n");
+		printf("=================================YOU ARE NOT THE OWNER!!!!!!!!!!!!!!!!!!!!!!!!!=======================================\n");
+		printf("=================================YOU ARE NOT THE OWNER!!!!!!!!!!!!!!!!!!!!!!!!!=======================================\n");
+		return;
+	}
+}
+
+void semaphore_init(sem_t *s, uint32_t count_) {
+	(*s).count = count_;
+	(*s).head = NULL;
+	(*s).block_current_task_next_preempt = false;
+	(*s).priority_ordered = false;
+	(*s).wait_bitmap = 0;
+	for (int i=0; i<NUM_PRIORITIES; i++)
+		(*s).wait_tail[i] = NULL;
+}
+
+//Semaphore whose signal wakes the highest priority waiter, rather than the one that has waited longest
+void semaphore_init_priority(sem_t *s, uint32_t count_) {
+	semaphore_init(s, count_);
+	(*s).priority_ordered = true;
+}
+
+//Links task into the semaphore's wait list behind every waiter of the same or higher priority. O(1), the tail of
+//the lowest such priority is found from the bitmap with one count leading zeros
+void sem_wait_insert(sem_t *s, uint8_t taskNum)
+{
+	uint8_t band = (*s).priority_ordered ? TCBS[taskNum].priority : 0;
+	Node_t *newNode = &TCBS[taskNum].node;
+	uint32_t same_or_higher = (*s).wait_bitmap & ~((1u << band) - 1);
+	
+	if (same_or_higher == 0)
+	{
+		(*newNode).next = (*s).head;
+		(*s).head = newNode;
+	}
+	else
+	{
+		Node_t *after = (*s).wait_tail[__CLZ(__RBIT(same_or_higher))];
+		(*newNode).next = (*after).next;
+		(*after).next = newNode;
+	}
+	
+	TCBS[taskNum].sem_band = band;
+	(*s).wait_tail[band] = newNode;
+	(*s).wait_bitmap |= 1u << band;
+}
+
+//Unlinks the first waiter, which is always the first of its priority, returns its task number. O(1)
+uint8_t sem_wait_pop(sem_t *s)
+{
+	Node_t *first = (*s).head;
+	uint8_t taskNum = (*first).task_num;
+	uint8_t band = TCBS[taskNum].sem_band;
+	
+	(*s).head = (*first).next;
+	(*first).next = NULL;
+	if ((*s).wait_tail[band] == first)
+	{
+		(*s).wait_tail[band] = NULL;
+		(*s).wait_bitmap &= ~(1u << band);
+	}
+	return taskNum;
+}
+
+//Unlinks a waiter from anywhere in the wait list, for timeouts and priority changes
+void sem_wait_remove(sem_t *s, uint8_t taskNum)
+{
+	Node_t *prev = NULL;
+	Node_t *target = (*s).head;
+	uint8_t band = TCBS[taskNum].sem_band;
+	
+	while (target != NULL && (*target).task_num != taskNum)
+	{
+		prev = target;
+		target = (*target).next;
+	}
+	if (target == NULL)
+		return;
+	
+	if (prev == NULL)
+		(*s).head = (*target).next;
+	else
+		(*prev).next = (*target).next;
+	(*target).next = NULL;
+	
+	//New tail of its priority is the waiter before it, if that one shares the priority
+	if ((*s).wait_tail[band] == target)
+	{
+		if (prev != NULL && TCBS[(*prev).task_num].sem_band == band)
+			(*s).wait_tail[band] = prev;
 		else
-			__enable_irq();
+		{
+			(*s).wait_tail[band] = NULL;
+			(*s).wait_bitmap &= ~(1u << band);
+		}
+	}
+}
+//Waits for the semaphore for at most ticks (wait_forever to never give up, 0 to only try).
+//Returns rtos_ok once the semaphore has been decremented for current task, rtos_timeout if it was not available in time
+uint8_t wait_timeout(sem_t *s, uint32_t ticks) {
+	enter_critical();
+	//Why in his notes does he do s<-s-1 in page 8 week 8
+	
+	//If semaphore is available
+	if ((*s).count > 0)
+	{
+		(*s).count--;
+		kernel_exit(bench_mask_wait);
+		return rtos_ok;
+	}
+	else if (ticks == 0)
+	{
+		kernel_exit(bench_mask_wait);
+		return rtos_timeout;
+	}
+	else//If semaphore is not available
+	{		
+		sem_wait_insert(s, currTask);
+		
+		//Blocks that task because it is trying to access an unavailable semaphore
+		TCBS[currTask].status = task_blocked_semaphore;
+		TCBS[currTask].blocked_on_sem = s;
+		//Also in the delay list, whichever of signal or the timeout comes first takes it off the other
+		if (ticks != wait_forever)
+			delay_list_insert(currTask, ticks);
+		
+		//Invokes PendSV_Handler
+		SCB->ICSR |= (1 << 28);
+		kernel_exit(bench_mask_wait);
+		
+		//Runs again once signal has passed the semaphore to this task, or the timeout ran out
+#if RTOS_BENCHMARK
+		if (TCBS[currTask].wait_result == rtos_ok)
+			benchmark_record(&bench_signal_wake, signal_wake_start);
+#endif
+		return TCBS[currTask].wait_result;
+	}
+}
+
+void wait(sem_t *s) {
+	wait_timeout(s, wait_forever);
+}
+
+//Gives the semaphore once, with interrupts already disabled. Returns the task it was handed to, 99 if none waited
+uint8_t semaphore_give(sem_t *s) {
+	if ((*s).head == NULL)//No other threads waiting, semaphore is incremented
+	{
+		(*s).count++;
+		return 99;
+	}
+	else//Removes first task in wait list and rewires it
+	{
+		//Node is reused by the ready list, so unlink it from wait list first
+		uint8_t unblocked = sem_wait_pop(s);
+		
+		//Semaphore is passed straight to the waiter rather than incremented, so no other task can take it first
+		delay_list_remove(unblocked);
+		TCBS[unblocked].wait_result = rtos_ok;
+		TCBS[unblocked].blocked_on_sem = NULL;
+		
+		//Unblock first task in wait list
+		make_ready(unblocked);
+#if RTOS_BENCHMARK
+		signal_wake_start = DWT->CYCCNT;
+#endif
+		return unblocked;
+	}
+}
+
+void signal(sem_t *s) {
+	enter_critical();
+	uint8_t woken = semaphore_give(s);
+	//Only switch if the woken task outranks current task, an equal one waits for its turn in the timeslice
+	bool preempt = woken != 99 && TCBS[woken].priority > TCBS[currTask].priority;
+	if (preempt)
+		SCB->ICSR |= (1 << 28);
+	kernel_exit(bench_mask_signal);
+	
+	if (preempt)
+		printf("I AM EXPLICITY INVOKING PENDSV HANDLER====================================");
+}
+
+//Signal for interrupt handlers: no printf and no PendSV of its own. Sets *switch_required when the woken task
+//outranks the interrupted one and leaves it alone otherwise, so one flag can collect every give in a handler
+//and be passed to yield_from_isr once at the end
+void signal_from_isr(sem_t *s, bool *switch_required) {
+	//Handler may run inside a task's critical section, so restore rather than unmask
+	uint32_t basepri = __get_BASEPRI();
+	kernel_lock();
+	uint8_t woken = semaphore_give(s);
+	kernel_restore(bench_mask_isr, basepri);
+	
+	if (woken != 99 && TCBS[woken].priority > TCBS[currTask].priority)
+		*switch_required = true;
+}
+
+//Called last in an interrupt handler with the flag from its _from_isr calls. Pends a single PendSV, which runs
+//once the handler and any other pending handlers return
+void yield_from_isr(bool switch_required) {
+	if (switch_required)
+		SCB->ICSR |= (1 << 28);
+}
+
+//Message queue of fixed size items, copied in and out of a caller supplied ring buffer of capacity items.
+//A reserved slot is written in place by the producer and becomes a message on queue_commit. Messages sent while
+//a slot is reserved go in the slots after it and are published with it, so messages always come out in order
+typedef struct{
+	uint8_t *buffer;
+	uint32_t item_size;
+	uint32_t capacity;
+	//Slot of the oldest message and messages that can be received, then 1 while a slot is reserved and not yet
+	//committed, then messages sent after the reserved slot that wait for its commit
+	uint32_t head;
+	uint32_t count;
+	uint32_t reserved;
+	uint32_t behind;
+	//Tasks waiting for room and for a message, highest priority first
+	Node_t *senders;
+	Node_t *receivers;
+}queue_t;
+
+//Storage must hold capacity * item_size bytes and live as long as the queue, e.g. a static array
+void queue_init(queue_t *q, void *storage, uint32_t item_size, uint32_t capacity) {
+	(*q).buffer = (uint8_t *)storage;
+	(*q).item_size = item_size;
+	(*q).capacity = capacity;
+	(*q).head = 0;
+	(*q).count = 0;
+	(*q).reserved = 0;
+	(*q).behind = 0;
+	(*q).senders = NULL;
+	(*q).receivers = NULL;
+}
+
+//Slot the next message or reservation goes in
+uint8_t *queue_write_slot(queue_t *q) {
+	return (*q).buffer + (((*q).head + (*q).count + (*q).reserved + (*q).behind) % (*q).capacity) * (*q).item_size;
+}
+
+//Room for one more message
+bool queue_has_room(queue_t *q) {
+	return (*q).count + (*q).reserved + (*q).behind < (*q).capacity;
+}
+
+//Copies item into the next slot. Receivable straight away, unless it is behind a reserved slot
+void queue_copy_in(queue_t *q, const void *item) {
+	memcpy(queue_write_slot(q), item, (*q).item_size);
+	if ((*q).reserved)
+		(*q).behind++;
+	else
+		(*q).count++;
+}
+
+//First waiting sender that can go now, 99 if none. A copying sender needs room, a waiting queue_reserve also
+//needs no other slot to be reserved, only one is reserved at a time
+uint8_t queue_ready_sender(queue_t *q) {
+	if (!queue_has_room(q))
+		return 99;
+	for (Node_t *sender = (*q).senders; sender != NULL; sender = (*sender).next)
+		if (TCBS[(*sender).task_num].queue_item != NULL || (*q).reserved == 0)
+			return (*sender).task_num;
+	return 99;
+}
+
+void queue_copy_out(queue_t *q, void *item) {
+	memcpy(item, (*q).buffer + (*q).head * (*q).item_size, (*q).item_size);
+	(*q).head = ((*q).head + 1) % (*q).capacity;
+	(*q).count--;
+}
+
+//Makes a task that waited on a queue ready again, it returns rtos_ok from its call
+void queue_wake(uint8_t taskNum) {
+	delay_list_remove(taskNum);
+	TCBS[taskNum].wait_result = rtos_ok;
+	TCBS[taskNum].blocked_on_list = NULL;
+	make_ready(taskNum);
+}
+
+//Serves waiters after the queue changed: a receiver is handed a message while there is one, a sender is given
+//room while there is some. Sender's item is copied straight into the queue, or it is given the slot it wanted to
+//reserve. Returns the highest priority woken, 0 if none was woken. Called with kernel interrupts masked
+uint8_t queue_settle(queue_t *q) {
+	uint8_t highest = 0;
+	uint8_t woken;
+	
+	while (true)
+	{
+		if ((*q).receivers != NULL && (*q).count > 0)
+		{
+			woken = (*(*q).receivers).task_num;
+			wait_list_remove(&(*q).receivers, woken);
+			queue_copy_out(q, TCBS[woken].queue_item);
+		}
+		else if ((woken = queue_ready_sender(q)) != 99)
+		{
+			wait_list_remove(&(*q).senders, woken);
+			if (TCBS[woken].queue_item != NULL)
+				queue_copy_in(q, TCBS[woken].queue_item);
+			else
+			{
+				TCBS[woken].queue_item = queue_write_slot(q);
+				(*q).reserved = 1;
+			}
+		}
+		else
+			return highest;
+		
+		queue_wake(woken);
+		if (TCBS[woken].priority > highest)
+			highest = TCBS[woken].priority;
+	}
+}
+
+//Blocks current task on one of the queue's wait lists, item is what the waker copies to or from. Called with
+//kernel interrupts masked, PendSV runs once the caller leaves its critical section
+void queue_block(Node_t **list, void *item, uint32_t ticks) {
+	TCBS[currTask].status = task_blocked_queue;
+	TCBS[currTask].blocked_on_list = list;
+	TCBS[currTask].queue_item = item;
+	wait_list_insert(list, currTask);
+	if (ticks != wait_forever)
+		delay_list_insert(currTask, ticks);
+	SCB->ICSR |= (1 << 28);
+}
+
+//Pends PendSV if a task woken by queue_settle outranks current task
+void queue_preempt(uint8_t highest) {
+	if (highest > TCBS[currTask].priority)
+		SCB->ICSR |= (1 << 28);
+}
+
+//Copies item into the queue, waiting at most ticks for room (wait_forever to never give up, 0 to only try).
+//Returns rtos_ok once queued, rtos_timeout if the queue stayed full
+uint8_t queue_send(queue_t *q, const void *item, uint32_t ticks) {
+	enter_critical();
+	
+	//Earlier senders keep their place in line
+	if (queue_has_room(q) && queue_ready_sender(q) == 99)
+	{
+		queue_copy_in(q, item);
+		queue_preempt(queue_settle(q));
+		kernel_exit(bench_mask_queue);
+		return rtos_ok;
+	}
+	if (ticks == 0)
+	{
+		kernel_exit(bench_mask_queue);
+		return rtos_timeout;
+	}
+	
+	queue_block(&(*q).senders, (void *)item, ticks);
+	kernel_exit(bench_mask_queue);
+	//Runs again once a receiver has copied item into the queue, or the timeout ran out
+	return TCBS[currTask].wait_result;
+}
+
+//Copies the oldest message into item, waiting at most ticks for one (wait_forever to never give up, 0 to only try).
+//Returns rtos_ok once received, rtos_timeout if the queue stayed empty
+uint8_t queue_receive(queue_t *q, void *item, uint32_t ticks) {
+	enter_critical();
+	
+	if ((*q).count > 0)
+	{
+		queue_copy_out(q, item);
+		queue_preempt(queue_settle(q));
+		kernel_exit(bench_mask_queue);
+		return rtos_ok;
+	}
+	if (ticks == 0)
+	{
+		kernel_exit(bench_mask_queue);
+		return rtos_timeout;
+	}
+	
+	queue_block(&(*q).receivers, item, ticks);
+	kernel_exit(bench_mask_queue);
+	//Runs again once a sender or commit has copied a message into item, or the timeout ran out
+	return TCBS[currTask].wait_result;
+}
+
+//Reserves the next slot so the producer can build its message in queue storage, waiting at most ticks for room.
+//Returns the slot, or NULL on timeout. Must be followed by queue_commit. Other senders carry on meanwhile, but
+//another queue_reserve waits for the commit
+void *queue_reserve(queue_t *q, uint32_t ticks) {
+	enter_critical();
+	
+	if ((*q).reserved == 0 && queue_has_room(q) && queue_ready_sender(q) == 99)
+	{
+		void *slot = queue_write_slot(q);
+		(*q).reserved = 1;
+		kernel_exit(bench_mask_queue);
+		return slot;
+	}
+	if (ticks == 0)
+	{
+		kernel_exit(bench_mask_queue);
+		return NULL;
+	}
+	
+	//No item, so queue_settle hands this task a reserved slot instead of copying
+	queue_block(&(*q).senders, NULL, ticks);
+	kernel_exit(bench_mask_queue);
+	if (TCBS[currTask].wait_result != rtos_ok)
+		return NULL;
+	return TCBS[currTask].queue_item;
+}
+
+//Publishes the reserved slot, and any messages sent behind it since, in the order they went in
+void queue_commit(queue_t *q) {
+	enter_critical();
+	(*q).count += 1 + (*q).behind;
+	(*q).reserved = 0;
+	(*q).behind = 0;
+	queue_preempt(queue_settle(q));
+	kernel_exit(bench_mask_queue);
+}
+
+//Send for interrupt handlers, never blocks. Returns rtos_timeout if the queue is full, a reserved slot does not
+//stop it. Sets *switch_required like signal_from_isr
+uint8_t queue_send_from_isr(queue_t *q, const void *item, bool *switch_required) {
+	uint8_t result = rtos_timeout;
+	uint32_t basepri = __get_BASEPRI();
+	kernel_lock();
+	if (queue_has_room(q) && queue_ready_sender(q) == 99)
+	{
+		queue_copy_in(q, item);
+		if (queue_settle(q) > TCBS[currTask].priority)
+			*switch_required = true;
+		result = rtos_ok;
+	}
+	kernel_restore(bench_mask_isr, basepri);
+	return result;
+}
+
+//Receive for interrupt handlers, never blocks. Returns rtos_timeout if the queue is empty
+uint8_t queue_receive_from_isr(queue_t *q, void *item, bool *switch_required) {
+	uint8_t result = rtos_timeout;
+	uint32_t basepri = __get_BASEPRI();
+	kernel_lock();
+	if ((*q).count > 0)
+	{
+		queue_copy_out(q, item);
+		if (queue_settle(q) > TCBS[currTask].priority)
+			*switch_required = true;
+		result = rtos_ok;
+	}
+	kernel_restore(bench_mask_isr, basepri);
+	return result;
+}
+
+//Event group, 32 flags that tasks wait on by mask. event_set wakes every waiter it satisfies in one pass
+typedef struct{
+	uint32_t flags;
+	//Waiting tasks, highest priority first
+	Node_t *waiters;
+}event_group_t;
+
+//event_wait options, or'd together. Default is to wake when any bit of the mask is set and leave flags set
+#define event_wait_all					1//Wake only when every bit of the mask is set
+#define event_clear_on_exit			2//Clear the mask's bits when the wait is satisfied
+
+void event_group_init(event_group_t *g) {
+	(*g).flags = 0;
+	(*g).waiters = NULL;
+}
+
+bool event_satisfied(uint32_t flags, uint32_t mask, uint8_t options) {
+	if (options & event_wait_all)
+		return (flags & mask) == mask;
+	return (flags & mask) != 0;
+}
+
+//Sets bits and wakes every waiter now satisfied, in one walk of the wait list. Bits of clear_on_exit waiters are
+//cleared only after the walk, so every waiter sees the same flags. Returns the highest priority woken, 0 if none.
+//Called with kernel interrupts masked
+uint8_t event_set_locked(event_group_t *g, uint32_t bits) {
+	uint8_t highest = 0;
+	uint32_t clear = 0;
+	Node_t **link = &(*g).waiters;
+	
+	(*g).flags |= bits;
+	while (*link != NULL)
+	{
+		uint8_t waiter = (**link).task_num;
+		if (!event_satisfied((*g).flags, TCBS[waiter].event_mask, TCBS[waiter].event_options))
+		{
+			link = &(**link).next;
+			continue;
+		}
+		
+		//Unlink before add_node reuses the node
+		*link = (**link).next;
+		TCBS[waiter].node.next = NULL;
+		if (TCBS[waiter].event_options & event_clear_on_exit)
+			clear |= TCBS[waiter].event_mask;
+		TCBS[waiter].event_flags = (*g).flags;
+		
+		delay_list_remove(waiter);
+		TCBS[waiter].wait_result = rtos_ok;
+		TCBS[waiter].blocked_on_list = NULL;
+		make_ready(waiter);
+		if (TCBS[waiter].priority > highest)
+			highest = TCBS[waiter].priority;
+	}
+	(*g).flags &= ~clear;
+	return highest;
+}
+
+//Waits until flags match mask, for at most ticks (wait_forever to never give up, 0 to only check). *flags, if not
+//NULL, gets the flags as they were when the wait was satisfied, before any clear_on_exit, or as they are on timeout.
+//Returns rtos_ok or rtos_timeout
+uint8_t event_wait(event_group_t *g, uint32_t mask, uint8_t options, uint32_t ticks, uint32_t *flags) {
+	enter_critical();
+	
+	if (event_satisfied((*g).flags, mask, options))
+	{
+		if (flags != NULL)
+			*flags = (*g).flags;
+		if (options & event_clear_on_exit)
+			(*g).flags &= ~mask;
+		kernel_exit(bench_mask_event);
+		return rtos_ok;
+	}
+	if (ticks == 0)
+	{
+		if (flags != NULL)
+			*flags = (*g).flags;
+		kernel_exit(bench_mask_event);
+		return rtos_timeout;
+	}
+	
+	TCBS[currTask].status = task_blocked_event;
+	TCBS[currTask].blocked_on_list = &(*g).waiters;
+	TCBS[currTask].event_mask = mask;
+	TCBS[currTask].event_options = options;
+	wait_list_insert(&(*g).waiters, currTask);
+	if (ticks != wait_forever)
+		delay_list_insert(currTask, ticks);
+	SCB->ICSR |= (1 << 28);
+	kernel_exit(bench_mask_event);
+	
+	//Runs again once event_set satisfied the wait, or the timeout ran out
+	if (flags != NULL)
+		*flags = TCBS[currTask].wait_result == rtos_ok ? TCBS[currTask].event_flags : (*g).flags;
+	return TCBS[currTask].wait_result;
+}
+
+void event_set(event_group_t *g, uint32_t bits) {
+	enter_critical();
+	if (event_set_locked(g, bits) > TCBS[currTask].priority)
+		SCB->ICSR |= (1 << 28);
+	kernel_exit(bench_mask_event);
+}
+
+//Set for interrupt handlers. Sets *switch_required like signal_from_isr, so every waiter woken by any number of
+//sets in one handler costs a single PendSV
+void event_set_from_isr(event_group_t *g, uint32_t bits, bool *switch_required) {
+	uint32_t basepri = __get_BASEPRI();
+	kernel_lock();
+	if (event_set_locked(g, bits) > TCBS[currTask].priority)
+		*switch_required = true;
+	kernel_restore(bench_mask_isr, basepri);
+}
+
+//Clears bits, returns the flags as they were before
+uint32_t event_clear(event_group_t *g, uint32_t bits) {
+	uint32_t basepri = __get_BASEPRI();
+	kernel_lock();
+	uint32_t flags = (*g).flags;
+	(*g).flags &= ~bits;
+	kernel_restore(bench_mask_event, basepri);
+	return flags;
+}
+
+//Direct to task notifications. Every task has a notification value in its TCB that other tasks and interrupt
+//handlers update with notify, so one to one signalling needs no kernel object and no wait list
+#define notify_signal						0//Only mark a notification pending, a binary semaphore
+#define notify_set_bits					1//Or value into the notification value, like a private event group
+#define notify_increment				2//Add 1 to the notification value, a counting semaphore
+#define notify_overwrite				3//Replace the notification value, a one item mailbox
+
+//Applies action to the task's value and readies it if it waits in notify_wait. Returns true if it was woken.
+//Called with kernel interrupts masked
+bool notify_locked(uint8_t taskNum, uint32_t value, uint8_t action) {
+	if (action == notify_set_bits)
+		TCBS[taskNum].notify_value |= value;
+	else if (action == notify_increment)
+		TCBS[taskNum].notify_value++;
+	else if (action == notify_overwrite)
+		TCBS[taskNum].notify_value = value;
+	TCBS[taskNum].notify_pending = true;
+	
+	if (TCBS[taskNum].status != task_blocked_notify)
+		return false;
+	
+	delay_list_remove(taskNum);
+	TCBS[taskNum].wait_result = rtos_ok;
+	make_ready(taskNum);
+#if RTOS_BENCHMARK
+	notify_wake_start = DWT->CYCCNT;
+#endif
+	return true;
+}
+
+//Notifies task, taskNum is the number returned by task_create
+void notify(uint8_t taskNum, uint32_t value, uint8_t action) {
+	enter_critical();
+	if (notify_locked(taskNum, value, action) && TCBS[taskNum].priority > TCBS[currTask].priority)
+		SCB->ICSR |= (1 << 28);
+	kernel_exit(bench_mask_notify);
+}
+
+//Notify for interrupt handlers, sets *switch_required like signal_from_isr
+void notify_from_isr(uint8_t taskNum, uint32_t value, uint8_t action, bool *switch_required) {
+	uint32_t basepri = __get_BASEPRI();
+	kernel_lock();
+	if (notify_locked(taskNum, value, action) && TCBS[taskNum].priority > TCBS[currTask].priority)
+		*switch_required = true;
+	kernel_restore(bench_mask_isr, basepri);
+}
+
+//Waits for a notification to current task, for at most ticks (wait_forever to never give up, 0 to only check).
+//*value, if not NULL, gets the notification value, which is then reset to 0, so with notify_increment it is the
+//number of notifications since the last wait. Returns rtos_ok or rtos_timeout
+uint8_t notify_wait(uint32_t ticks, uint32_t *value) {
+	enter_critical();
+	
+	if (!TCBS[currTask].notify_pending)
+	{
+		if (ticks == 0)
+		{
+			kernel_exit(bench_mask_notify);
+			return rtos_timeout;
+		}
+		
+		//No wait list, the notifier finds this task by number
+		TCBS[currTask].status = task_blocked_notify;
+		if (ticks != wait_forever)
+			delay_list_insert(currTask, ticks);
+		SCB->ICSR |= (1 << 28);
+		kernel_exit(bench_mask_notify);
+		
+		//Runs again once notified, or the timeout ran out
+		if (TCBS[currTask].wait_result != rtos_ok)
+			return rtos_timeout;
+#if RTOS_BENCHMARK
+		benchmark_record(&bench_notify_wake, notify_wake_start);
+#endif
+		enter_critical();
+	}
+	
+	if (value != NULL)
+		*value = TCBS[currTask].notify_value;
+	TCBS[currTask].notify_value = 0;
+	TCBS[currTask].notify_pending = false;
+	kernel_exit(bench_mask_notify);
+	return rtos_ok;
+}
+
+//Pool of equal sized blocks carved from static storage. Free blocks are linked through their own first word,
+//so alloc and free only pop and push the front of the free list
+typedef struct{
+	void *free_list;
+	uint32_t block_size;
+	uint32_t num_blocks;
+	//Blocks handed out now, and the most ever handed out at once
+	uint32_t used;
+	uint32_t high_water;
+}pool_t;
+
+//Declares word aligned storage for a pool of blocks blocks of block_size bytes
+#define POOL_STORAGE(name, block_size, blocks)	uint32_t name[(((block_size) + 3) / 4) * (blocks)]
+
+//Storage must come from POOL_STORAGE with the same block_size and num_blocks
+void pool_init(pool_t *p, uint32_t *storage, uint32_t block_size, uint32_t num_blocks) {
+	//Whole words, so every block stays word aligned and can hold the free list link
+	uint32_t block_words = (block_size + 3) / 4;
+	
+	(*p).block_size = block_words * 4;
+	(*p).num_blocks = num_blocks;
+	(*p).used = 0;
+	(*p).high_water = 0;
+	(*p).free_list = NULL;
+	//Pushed last to first, so blocks are handed out in address order
+	for (uint32_t i = num_blocks; i > 0; i--)
+	{
+		void **block = (void **)(storage + (i - 1) * block_words);
+		*block = (*p).free_list;
+		(*p).free_list = block;
+	}
+}
+
+//Returns a block, or NULL if every block is in use. Safe from tasks and interrupt handlers
+void *pool_alloc(pool_t *p) {
+	uint32_t basepri = __get_BASEPRI();
+	kernel_lock();
+	void **block = (void **)(*p).free_list;
+	if (block != NULL)
+	{
+		(*p).free_list = *block;
+		(*p).used++;
+		if ((*p).used > (*p).high_water)
+			(*p).high_water = (*p).used;
+	}
+	kernel_restore(bench_mask_pool, basepri);
+	return block;
+}
+
+//Returns a block from pool_alloc on the same pool. Safe from tasks and interrupt handlers
+void pool_free(pool_t *p, void *block) {
+	uint32_t basepri = __get_BASEPRI();
+	kernel_lock();
+	*(void **)block = (*p).free_list;
+	(*p).free_list = block;
+	(*p).used--;
+	kernel_restore(bench_mask_pool, basepri);
+}
+
+void pool_print(const char *name, pool_t *p) {
+	printf("POOL %s: %d of %d blocks of %d bytes used, high water %d\n", name, (*p).used, (*p).num_blocks, (*p).block_size, (*p).high_water);
+}
+
+//Variable size heap, a two level segregated fit allocator. Free blocks are kept in lists by size class: the first
+//level is the power of two of the size, the second splits each power of two into HEAP_SL_COUNT equal ranges.
+//A bitmap per level finds a non-empty list that is large enough with count leading zeros, so malloc and free
+//never walk a list or the heap. Only tasks may use it, it is locked with scheduler_suspend so interrupts stay on;
+//interrupt handlers use pools
+#define HEAP_ALIGN				8
+#define HEAP_SL_LOG				4
+#define HEAP_SL_COUNT			(1 << HEAP_SL_LOG)
+//Blocks below HEAP_SMALL bytes all share first level 0, in HEAP_ALIGN steps
+#define HEAP_SMALL				(HEAP_SL_COUNT * HEAP_ALIGN)
+#define HEAP_FL_SHIFT			6
+#define HEAP_FL_COUNT			12
+
+#if HEAP_SIZE >= (1 << (HEAP_FL_COUNT + HEAP_FL_SHIFT))
+#error "HEAP_SIZE is too large for HEAP_FL_COUNT size classes"
+#endif
+
+//Header in front of every block. prev_phys is the block just below in memory, so free can merge with it.
+//size includes the header, low bit set while the block is free. The free list links are only used by free blocks
+//and are where a used block's data starts
+typedef struct heap_block_t{
+	struct heap_block_t *prev_phys;
+	uint32_t size;
+	struct heap_block_t *next_free;
+	struct heap_block_t *prev_free;
+}heap_block_t;
+
+#define HEAP_HEADER				((uint32_t)offsetof(heap_block_t, next_free))
+#define HEAP_MIN_BLOCK		((uint32_t)sizeof(heap_block_t))
+#define heap_block_free		1u
+#define heap_size(b)			((*(b)).size & ~heap_block_free)
+#define heap_next_phys(b)	((heap_block_t *)((uint8_t *)(b) + heap_size(b)))
+
+//Heap memory, its own zero initialised section like the stack region
+uint32_t heap_region[HEAP_SIZE/4] __attribute__((section("kernel_heap"), zero_init, aligned(8)));
+
+heap_block_t *heap_lists[HEAP_FL_COUNT][HEAP_SL_COUNT];
+uint32_t heap_fl_bitmap;
+uint32_t heap_sl_bitmap[HEAP_FL_COUNT];
+
+//Bytes in free blocks, its lowest value so far, and blocks handed out
+uint32_t heap_free_bytes;
+uint32_t heap_min_free_bytes;
+uint32_t heap_used_blocks;
+
+//Size class of a block size
+void heap_mapping(uint32_t size, uint32_t *fl, uint32_t *sl)
+{
+	if (size < HEAP_SMALL)
+	{
+		*fl = 0;
+		*sl = size / HEAP_ALIGN;
+	}
+	else
+	{
+		uint32_t f = 31 - __CLZ(size);
+		*sl = (size >> (f - HEAP_SL_LOG)) ^ HEAP_SL_COUNT;
+		*fl = f - HEAP_FL_SHIFT;
+	}
+}
+
+void heap_insert_free(heap_block_t *b)
+{
+	uint32_t fl, sl;
+	heap_mapping(heap_size(b), &fl, &sl);
+	
+	(*b).prev_free = NULL;
+	(*b).next_free = heap_lists[fl][sl];
+	if ((*b).next_free != NULL)
+		(*(*b).next_free).prev_free = b;
+	heap_lists[fl][sl] = b;
+	heap_fl_bitmap |= 1u << fl;
+	heap_sl_bitmap[fl] |= 1u << sl;
+}
+
+void heap_remove_free(heap_block_t *b)
+{
+	uint32_t fl, sl;
+	heap_mapping(heap_size(b), &fl, &sl);
+	
+	if ((*b).prev_free != NULL)
+		(*(*b).prev_free).next_free = (*b).next_free;
+	else
+		heap_lists[fl][sl] = (*b).next_free;
+	if ((*b).next_free != NULL)
+		(*(*b).next_free).prev_free = (*b).prev_free;
+	
+	if (heap_lists[fl][sl] == NULL)
+	{
+		heap_sl_bitmap[fl] &= ~(1u << sl);
+		if (heap_sl_bitmap[fl] == 0)
+			heap_fl_bitmap &= ~(1u << fl);
+	}
+}
+
+//Heap is one free block, closed by a used block of size 0 so the last block's heap_next_phys stays in the heap
+void heap_init(void)
+{
+	heap_block_t *first = (heap_block_t *)heap_region;
+	heap_block_t *end = (heap_block_t *)((uint8_t *)heap_region + HEAP_SIZE - HEAP_HEADER);
+	
+	for (int i=0; i<HEAP_FL_COUNT; i++)
+	{
+		heap_sl_bitmap[i] = 0;
+		for (int j=0; j<HEAP_SL_COUNT; j++)
+			heap_lists[i][j] = NULL;
+	}
+	heap_fl_bitmap = 0;
+	
+	(*first).prev_phys = NULL;
+	(*first).size = (HEAP_SIZE - HEAP_HEADER) | heap_block_free;
+	(*end).prev_phys = first;
+	(*end).size = 0;
+	heap_insert_free(first);
+	
+	heap_free_bytes = HEAP_SIZE - HEAP_HEADER;
+	heap_min_free_bytes = heap_free_bytes;
+	heap_used_blocks = 0;
+}
+
+//Returns at least size bytes, 8 byte aligned, or NULL if no free block is large enough
+void *heap_malloc(uint32_t size)
+{
+	if (size == 0 || size > HEAP_SIZE)
+		return NULL;
+	
+	uint32_t need = (size + HEAP_HEADER + HEAP_ALIGN - 1) & ~(HEAP_ALIGN - 1);
+	if (need < HEAP_MIN_BLOCK)
+		need = HEAP_MIN_BLOCK;
+	
+	//Round up to the start of the next size class, so any block in the class found is large enough
+	uint32_t search = need;
+	if (search >= HEAP_SMALL)
+		search += (1u << (31 - __CLZ(search) - HEAP_SL_LOG)) - 1;
+	uint32_t fl, sl;
+	heap_mapping(search, &fl, &sl);
+	
+	scheduler_suspend();
+	
+	//Same first level at sl or above, otherwise smallest list of a larger first level
+	heap_block_t *b = NULL;
+	uint32_t sl_map = fl < HEAP_FL_COUNT ? heap_sl_bitmap[fl] & (~0u << sl) : 0;
+	if (sl_map == 0)
+	{
+		uint32_t fl_map = fl + 1 < HEAP_FL_COUNT ? heap_fl_bitmap & (~0u << (fl + 1)) : 0;
+		if (fl_map != 0)
+		{
+			fl = __CLZ(__RBIT(fl_map));
+			sl_map = heap_sl_bitmap[fl];
+		}
+	}
+	if (sl_map != 0)
+		b = heap_lists[fl][__CLZ(__RBIT(sl_map))];
+	else
+	{
+		//Nothing in a larger class, but the first block of need's own class may still be big enough
+		heap_mapping(need, &fl, &sl);
+		if (fl < HEAP_FL_COUNT && heap_lists[fl][sl] != NULL && heap_size(heap_lists[fl][sl]) >= need)
+			b = heap_lists[fl][sl];
+	}
+	if (b == NULL)
+	{
+		scheduler_resume();
+		return NULL;
+	}
+	
+	heap_remove_free(b);
+	
+	//Give the tail back if it can hold a block of its own
+	uint32_t block_size = heap_size(b);
+	if (block_size - need >= HEAP_MIN_BLOCK)
+	{
+		heap_block_t *rest = (heap_block_t *)((uint8_t *)b + need);
+		(*rest).prev_phys = b;
+		(*rest).size = (block_size - need) | heap_block_free;
+		(*heap_next_phys(rest)).prev_phys = rest;
+		heap_insert_free(rest);
+		block_size = need;
+	}
+	(*b).size = block_size;
+	
+	heap_free_bytes -= block_size;
+	if (heap_free_bytes < heap_min_free_bytes)
+		heap_min_free_bytes = heap_free_bytes;
+	heap_used_blocks++;
+	
+	scheduler_resume();
+	return (uint8_t *)b + HEAP_HEADER;
+}
+
+//Returns memory from heap_malloc, merging it with free neighbours. NULL is ignored
+void heap_free(void *ptr)
+{
+	if (ptr == NULL)
+		return;
+	
+	heap_block_t *b = (heap_block_t *)((uint8_t *)ptr - HEAP_HEADER);
+	
+	scheduler_suspend();
+	
+	heap_free_bytes += heap_size(b);
+	heap_used_blocks--;
+	
+	heap_block_t *next = heap_next_phys(b);
+	if ((*next).size & heap_block_free)
+	{
+		heap_remove_free(next);
+		(*b).size += heap_size(next);
+	}
+	heap_block_t *prev = (*b).prev_phys;
+	if (prev != NULL && ((*prev).size & heap_block_free))
+	{
+		heap_remove_free(prev);
+		(*prev).size = heap_size(prev) + heap_size(b);
+		b = prev;
+	}
+	(*b).size |= heap_block_free;
+	(*heap_next_phys(b)).prev_phys = b;
+	heap_insert_free(b);
+	
+	scheduler_resume();
+}
+
+//Largest size heap_malloc can return now. A request is rounded up to the next size class, and only the first
+//block of its own class is tried when that class is the highest, so the first block of the highest non-empty
+//list is the largest block that can be handed out, even if a larger one sits behind it in that list
+uint32_t heap_largest_alloc(void)
+{
+	uint32_t largest = 0;
+	
+	scheduler_suspend();
+	if (heap_fl_bitmap != 0)
+	{
+		uint32_t fl = 31 - __CLZ(heap_fl_bitmap);
+		uint32_t sl = 31 - __CLZ(heap_sl_bitmap[fl]);
+		largest = heap_size(heap_lists[fl][sl]) - HEAP_HEADER;
+	}
+	scheduler_resume();
+	return largest;
+}
+
+//Fragmentation is the share of free bytes that the largest possible allocation cannot use, 0% when all free
+//space is one block
+void heap_print_stats(void)
+{
+	uint32_t largest = heap_largest_alloc();
+	uint32_t usable = largest ? largest + HEAP_HEADER : 0;
+	uint32_t fragmentation = heap_free_bytes ? 100 - (uint32_t)((uint64_t)usable * 100 / heap_free_bytes) : 0;
+	printf("HEAP: %d blocks used, %d of %d bytes free, %d lowest, largest allocation %d, %d%% fragmented\n",
+		heap_used_blocks, heap_free_bytes, HEAP_SIZE, heap_min_free_bytes, largest, fragmentation);
+}
+
+#if RTOS_BENCHMARK
+//Allocation latency over a random mix of heap_malloc and heap_free calls of 8 to 256 bytes, recorded in
+//bench_heap_malloc and bench_heap_free. Everything allocated is freed again before it returns
+void heap_benchmark(uint32_t rounds)
+{
+	void *slots[16] = {NULL};
+	uint32_t seed = 1;
+	
+	for (uint32_t i = 0; i < rounds; i++)
+	{
+		//Linear congruential generator, repeatable between runs
+		seed = seed * 1664525 + 1013904223;
+		uint32_t slot = (seed >> 16) % 16;
+		uint32_t start = DWT->CYCCNT;
+		
+		if (slots[slot] != NULL)
+		{
+			heap_free(slots[slot]);
+			benchmark_record(&bench_heap_free, start);
+			slots[slot] = NULL;
+		}
+		else
+		{
+			slots[slot] = heap_malloc(8 + (seed >> 8) % 249);
+			benchmark_record(&bench_heap_malloc, start);
+		}
+	}
+	
+	heap_print_stats();
+	for (int i=0; i<16; i++)
+		heap_free(slots[i]);
+}
+#endif
+
+sem_t lock1;
+sem_t lock2;
+
+//Inserts task into the delay list to be made ready after the given number of ticks
+void delay_list_insert(uint8_t taskNum, uint32_t ticks)
+{
+	uint8_t prev = 99;
+	uint8_t next = delay_head;
+	
+	//Walk past every task due no later than this one, so equal wake-ups stay first come first served
+	while (next != 99 && TCBS[next].delay_delta <= ticks)
+	{
+		ticks -= TCBS[next].delay_delta;
+		prev = next;
+		next = TCBS[next].delay_next;
+	}
+	
+	TCBS[taskNum].delay_delta = ticks;
+	TCBS[taskNum].delay_next = next;
+	TCBS[taskNum].delay_prev = prev;
+	TCBS[taskNum].delayed = true;
+	//Task after the new one is now relative to it
+	if (next != 99)
+	{
+		TCBS[next].delay_delta -= ticks;
+		TCBS[next].delay_prev = taskNum;
+	}
+	if (prev == 99)
+		delay_head = taskNum;
+	else
+		TCBS[prev].delay_next = taskNum;
+}
+
+//Takes a task out of the delay list before its time runs out, e.g. when a timed wait is satisfied. O(1), the
+//task's remaining delta is handed on to the task after it
+void delay_list_remove(uint8_t taskNum)
+{
+	if (!TCBS[taskNum].delayed)
+		return;
+	
+	uint8_t prev = TCBS[taskNum].delay_prev;
+	uint8_t next = TCBS[taskNum].delay_next;
+	if (next != 99)
+	{
+		TCBS[next].delay_delta += TCBS[taskNum].delay_delta;
+		TCBS[next].delay_prev = prev;
+	}
+	if (prev == 99)
+		delay_head = next;
+	else
+		TCBS[prev].delay_next = next;
+	
+	TCBS[taskNum].delay_next = 99;
+	TCBS[taskNum].delay_prev = 99;
+	TCBS[taskNum].delayed = false;
+}
+
+//Counts elapsed ticks off the front of the delay list and readies every task whose delay has run out
+void delay_list_advance(uint32_t elapsed)
+{
+	while (delay_head != 99)
+	{
+		uint8_t expired = delay_head;
+		if (TCBS[expired].delay_delta > elapsed)
+		{
+			TCBS[expired].delay_delta -= elapsed;
+			return;
+		}
+		elapsed -= TCBS[expired].delay_delta;
+		
+		delay_head = TCBS[expired].delay_next;
+		if (delay_head != 99)
+			TCBS[delay_head].delay_prev = 99;
+		TCBS[expired].delay_next = 99;
+		TCBS[expired].delay_delta = 0;
+		TCBS[expired].delayed = false;
+		
+		//Timed out waiting on a semaphore, mutex, queue or event group, so it also comes off that wait list
+		if (TCBS[expired].status == task_blocked_semaphore)
+		{
+			sem_wait_remove(TCBS[expired].blocked_on_sem, expired);
+			TCBS[expired].blocked_on_sem = NULL;
+		}
+		else if (TCBS[expired].status == task_blocked_mutex)
+		{
+			mutex_t *m = TCBS[expired].blocked_on_mutex;
+			wait_list_remove(&(*m).head, expired);
+			TCBS[expired].blocked_on_mutex = NULL;
+			mutex_waiter_left(m);
+		}
+		else if (TCBS[expired].status == task_blocked_queue || TCBS[expired].status == task_blocked_event)
+		{
+			wait_list_remove(TCBS[expired].blocked_on_list, expired);
+			TCBS[expired].blocked_on_list = NULL;
+		}
+		TCBS[expired].wait_result = rtos_timeout;
+		
+		make_ready(expired);
 	}
-	else
+}
+
+//True if a ready task outranks the running task, so it should pre-empt now instead of at the end of the timeslice
+bool higher_priority_ready(void)
+{
+	return ready_bitmap != 0 && (31 - __CLZ(ready_bitmap)) > TCBS[currTask].priority;
+}
+
+//Blocks current task for a number of milliseconds, woken by the SysTick interrupt that ends the delay.
+//Delay starts from the current tick, so the task sleeps between ms-1 and ms milliseconds. rtosDelay(0) just yields
+void rtosDelay(uint32_t ms)
+{
+	enter_critical();
+	//Current task node is already removed from linked list array so just need to update its status and delay list position
+	if (ms > 0)
 	{
-		printf("=================================YOU ARE NOT THE OWNER!!!!!!!!!!!!!!!!!!!!!!!!!=======================================\n");
-		printf("=================================YOU ARE NOT THE OWNER!!!!!!!!!!!!!!!!!!!!!!!!!=======================================\n");
-		printf("=================================YOU ARE NOT THE OWNER!!!!!!!!!!!!!!!!!!!!!!!!!=======================================\n");
-		printf("=================================YOU ARE NOT THE OWNER!!!!!!!!!!!!!!!!!!!!!!!!!=======================================\n");
-		printf("=================================YOU ARE NOT THE OWNER!!!!!!!!!!!!!!!!!!!!!!!!!=======================================\n");
-		printf("=================================YOU ARE NOT THE OWNER!!!!!!!!!!!!!!!!!!!!!!!!!=======================================\n");
-		printf("=================================YOU ARE NOT THE OWNER!!!!!!!!!!!!!!!!!!!!!!!!!=======================================\n");
-		printf("=================================YOU ARE NOT THE OWNER!!!!!!!!!!!!!!!!!!!!!!!!!=======================================\n");
-		printf("=================================YOU ARE NOT THE OWNER!!!!!!!!!!!!!!!!!!!!!!!!!=======================================\n");
-		return;
+		TCBS[currTask].status = task_blocked;
+		delay_list_insert(currTask, ms);
 	}
+	//Give up the CPU now rather than at the next timeslice
+	SCB->ICSR |= (1 << 28);
+	kernel_exit(bench_mask_delay);
 }
 
-void semaphore_init(sem_t *s, uint32_t count_) {
-	(*s).count = count_;
-	(*s).head = NULL;
-	(*s).block_current_task_next_preempt = false;
+//Ticks the clock, wakes delayed tasks that are due and pre-empts for timeslices or a higher priority wake-up
+void SysTick_Handler(void) {
+#if TICKLESS_IDLE
+	systick_interrupts++;
+#endif
+	//Only tasks whose delay runs out this tick are touched
+#if RTOS_BENCHMARK
+	uint32_t delay_start = DWT->CYCCNT;
+#endif
+	//Peripheral handlers can preempt SysTick and ready tasks with the _from_isr calls, so lists are locked here too
+	kernel_lock();
+	delay_list_advance(1);
+	bool preempt = higher_priority_ready();
+	kernel_unlock(bench_mask_tick);
+#if RTOS_BENCHMARK
+	benchmark_record(&bench_delay, delay_start);
+#endif
+	
+	// When context switch required, end of timeslice or woken task outranks current task
+	if (!(msTicks % TIMESLICE_MS) || preempt) {
+		// Write 1 to PENDSVSET bit of ICSR
+		SCB->ICSR |= (1 << 28);
+	}
+	msTicks++;
 }
-void wait(sem_t *s) {
+
+#if TICKLESS_IDLE
+//Returns number of SysTick periods until the interrupt that wakes the earliest delayed task, 0 if no task is delayed
+uint32_t ticks_until_next_wakeup(void)
+{
+	//Front of delay list is the earliest wake-up
+	if (delay_head == 99)
+		return 0;
+	return TCBS[delay_head].delay_delta;
+}
+
+//Advances msTicks and the delay list over ticks whose interrupts were suppressed
+void account_suppressed_ticks(uint32_t ticks)
+{
+	msTicks += ticks;
+	delay_list_advance(ticks);
+}
+
+//Called from idle task. If no other task is ready, stops the 1 ms tick and sleeps until the next delayed task is due
+void tickless_idle(void)
+{
+	uint32_t ticks_per_ms = SystemCoreClock / 1000;
+	//Longest sleep the 24 bit SysTick reload register can time
+	uint32_t max_ticks = SysTick_LOAD_RELOAD_Msk / ticks_per_ms;
+	
+	//PRIMASK rather than the kernel's BASEPRI, an interrupt masked by BASEPRI would not end WFI
 	__disable_irq();
-	//Why in his notes does he do s<-s-1 in page 8 week 8
 	
-	//If semaphore is available
-	if ((*s).count > 0)
+	//Other tasks ready, a switch already requested or a tick not yet handled, stay awake
+	if (ready_bitmap != 0 || (SCB->ICSR & (SCB_ICSR_PENDSVSET_Msk | SCB_ICSR_PENDSTSET_Msk)))
 	{
-		(*s).count--;
 		__enable_irq();
 		return;
 	}
-	else//If semaphore is not available
-	{		
-		//Iterates down wait list and adds new node
-		Node_t *currNode;
-		if ((*s).head == NULL)
-		{
-			Node_t* newNode = (Node_t*)malloc(sizeof(Node_t));
-			(*s).head = newNode;
-			(*((*s).head)).task_num = currTask;
-			(*((*s).head)).next = NULL;
-		}
-		else
-		{
-			currNode = (*s).head;
-
-			while ((*currNode).next != NULL)
-			{
-				currNode = (*currNode).next;
-			}
-		
-			Node_t* newNode = (Node_t*)malloc(sizeof(Node_t));
-			(*newNode).task_num = currTask;
-			(*newNode).next = NULL;
-			(*currNode).next = newNode;
-		}
-		
-		//Blocks that task because it is trying to access an unavailable semaphore
-		TCBS[currTask].status = task_blocked_semaphore;
-		TCBS[currTask].when_unblocked_decrease_semaphore = s;
-		
-		
-		//Invokes PendSV_Handler
-		printf("I AM EXPLICITY INVOKING PENDSV HANDLER====================================");
+	
+	uint32_t sleep_ticks = ticks_until_next_wakeup();
+	if (sleep_ticks == 0 || sleep_ticks > max_ticks)
+		sleep_ticks = max_ticks;
+	//Next tick already does the wake-up, nothing to suppress
+	if (sleep_ticks < 2)
+	{
 		__enable_irq();
-		SCB->ICSR |= (1 << 28);
+		return;
 	}
-}
-
-void signal(sem_t *s) {
-	__disable_irq();
 	
-	if ((*s).head == NULL)//No other threads waiting, does nothing
-	{}
-	else if ((*((*s).head)).next == NULL)//Deletes first task in wait list
+	//Reprogram SysTick to fire once at the wake-up tick: the rest of the current tick plus sleep_ticks - 1 whole ones
+	SysTick->CTRL &= ~SysTick_CTRL_ENABLE_Msk;
+	SysTick->LOAD = SysTick->VAL + (sleep_ticks - 1) * ticks_per_ms - 1;
+	SysTick->VAL = 0;
+	SysTick->CTRL |= SysTick_CTRL_ENABLE_Msk;
+	
+	//Interrupts stay masked so nothing runs until msTicks is fixed, but a pending interrupt still ends WFI
+	__DSB();
+	__WFI();
+	
+	//Reading CTRL clears COUNTFLAG, so read it once
+	uint32_t ctrl = SysTick->CTRL;
+	SysTick->CTRL = ctrl & ~SysTick_CTRL_ENABLE_Msk;
+	uint32_t val = SysTick->VAL;
+	//Counts left of the tick in progress
+	uint32_t next;
+	
+	if (ctrl & SysTick_CTRL_COUNTFLAG_Msk)
 	{
-		//Unblock first task in wait list
-		TCBS[(*((*s).head)).task_num].status = task_ready;
-		add_node(TCBS[(*((*s).head)).task_num].priority, (*((*s).head)).task_num);
-		
-		//Deletes first task in wait list
-		free((*s).head);
-		(*s).head = NULL;
+		//SysTick ended the sleep, its pending interrupt handles the last tick when interrupts are enabled.
+		//The counter reloaded at that tick, LOAD - val counts of the next one have run since
+		account_suppressed_ticks(sleep_ticks - 1);
+		uint32_t since = SysTick->LOAD - val;
+		next = since < ticks_per_ms ? ticks_per_ms - since : 0;
 	}
-	else//Deletes first task in wait list and rewires it
+	else
 	{
-		//Unblock first task in wait list
-		TCBS[(*((*s).head)).task_num].status = task_ready;
-		add_node(TCBS[(*((*s).head)).task_num].priority, (*((*s).head)).task_num);
-		
-		//Deletes first task in wait list and rewires it
-		Node_t *secondInWaitList = (*((*s).head)).next;
-		free((*s).head);
-		(*s).head = secondInWaitList;
+		//Another interrupt woke us early. val counts are left to the wake-up tick, whole ticks among them have
+		//not happened yet and the remainder is what is left of the tick in progress
+		account_suppressed_ticks(sleep_ticks - 1 - val / ticks_per_ms);
+		next = val % ticks_per_ms;
 	}
+	//LOAD of 0 never fires, take a tick that is already due on the next count
+	if (next < 2)
+		next = 2;
 	
-	(*s).count++;
+	//Finish the tick in progress, VAL only clears so the leftover has to go through LOAD. The 1 ms reload
+	//written after the restart takes effect when that period ends
+	SysTick->LOAD = next - 1;
+	SysTick->VAL = 0;
+	SysTick->CTRL = ctrl | SysTick_CTRL_ENABLE_Msk;
+	SysTick->LOAD = ticks_per_ms - 1;
 	
 	__enable_irq();
-	
-	printf("I AM EXPLICITY INVOKING PENDSV HANDLER====================================");
-		SCB->ICSR |= (1 << 28);
 }
+#endif
 
-sem_t lock1;
-sem_t lock2;
-
-void rtosDelay(int num_timeslices)
+#if PENDSV_TRACE
+//Prints the switch PendSV_Handler just made, task states and priority lists. Called after the kernel lock is
+//released, so the prints never hold off kernel interrupts; lists may change while they are printed
+void pendsv_trace(uint8_t prev_task)
 {
-	//Blocks current task, current task node is already removed from linked list array so just need to update its
-	//status, and the next PendSV_Handler will handle everything
-	TCBS[currTask].status = task_blocked;
-	TCBS[currTask].timeslices_to_be_blocked = num_timeslices;
-	TCBS[currTask].timeslices_since_blocked = 0;
-}
-
-void PendSV_Handler(void) {
 	printf("\n\n=============PENDSV BEGIN===============\n\n");			
 	printf("numTasks: %d\n", numTasks);
 	printf("createdTasks: %d\n", createdTasks);
-	printf("currTask: %d\n", currTask);
-	
-	//Increments each blocked task's timeslices_since_blocked, and checks if blocked tasks are to be made active
-	for (int i=0; i<createdTasks; i++)
-	{
-		if (TCBS[i].status == task_blocked)
-		{
-			TCBS[i].timeslices_since_blocked++;
-			if (TCBS[i].timeslices_since_blocked > TCBS[i].timeslices_to_be_blocked)
-			{
-				add_node(TCBS[i].priority, i);
-				TCBS[i].status = task_ready;
-				printf("==============================================Task: %d no longer blocked\n", i);
-			}
-		}
-	}
 	
 	for (int i=0; i<createdTasks; i++)
 		printf("TASK %d STATUS: %d\n", i, TCBS[i].status);
-	
-	//TWO THINGS CHECKED HERE: 1. If it hasnt been blocked in last timeslice, put back. 2. If block flag set, DO NOT put back.
-	if (TCBS[currTask].status == task_ready)
-	{
-		//If needs to be added in different priority because done priority inheritance
-		if (TCBS[currTask].add_in_different_priority)
-		{
-			add_node(TCBS[currTask].different_priority, currTask);
-			TCBS[currTask].add_in_different_priority = false;
-			TCBS[currTask].different_priority = 99;
-		}
-		else//Normal add back
-			add_node(TCBS[currTask].priority, currTask);
-	}
-	else
-		printf("I have blocked task <%d>\n", currTask);
+	if (TCBS[prev_task].status != task_ready)
+		printf("I have blocked task <%d>\n", prev_task);
 	
 	//==================Print out bit vector lists
-	for (int priority = 0; priority<6; priority++)
+	for (int priority = 0; priority<NUM_PRIORITIES; priority++)
 	{
 		Node_t *currNode = schedule_array[priority];
 
@@ -361,9 +1986,55 @@ void PendSV_Handler(void) {
 	}
 	printf("\n");
 	//=================================================
+	
+	printf("prev task: %d\n", prev_task);
+	printf("next task: %d\n", currTask);
+	printf("\n\n=============PENDSV END===============\n\n");		
+}
+#endif
+
+void PendSV_Handler(void) {
+	//Kernel interrupts could change the lists while the next task is chosen
+	kernel_lock();
+	
+	//Scheduler suspended, remember the switch for scheduler_resume and go back to the running task untouched.
+	//A task that blocked anyway still has to be switched out
+	if (scheduler_lock_count > 0 && TCBS[currTask].status == task_ready)
+	{
+		switch_deferred = true;
+		kernel_unlock(bench_mask_pendsv);
+		return;
+	}
+#if PENDSV_TRACE
+	uint8_t prev_task = currTask;
+#endif
+	
+	//TWO THINGS CHECKED HERE: 1. If it hasnt been blocked in last timeslice, put back. 2. If block flag set, DO NOT put back.
+	if (TCBS[currTask].status == task_ready)
+		add_node(TCBS[currTask].priority, currTask);
 
 	//Finds next task
+#if RTOS_BENCHMARK
+	uint32_t schedule_start = DWT->CYCCNT;
+#endif
 	next_task = find_next_task();
+#if RTOS_BENCHMARK
+	benchmark_record(&bench_schedule, schedule_start);
+	if (next_task != currTask)
+		context_switches++;
+#endif
+	
+	//Current task is still the one to run, e.g. a signal woke an equal or lower priority task. Take it back off
+	//its ready list and return without saving or restoring any registers
+	if (next_task == currTask)
+	{
+		remove_front_node(TCBS[currTask].priority);
+		kernel_unlock(bench_mask_pendsv);
+#if PENDSV_TRACE
+		pendsv_trace(prev_task);
+#endif
+		return;
+	}
 	
 	//Pushes register contents onto current task's stack and updates its stack pointer
 	TCBS[currTask].stack_pointer = (uint32_t *)storeContext();
@@ -371,25 +2042,19 @@ void PendSV_Handler(void) {
 	//Pops new task's registers content (stored on its stack) into registers
 	restoreContext((uint32_t)TCBS[next_task].stack_pointer);
 	
-	printf("prev task: %d\n", currTask);
 	//Updates current task
 	currTask = next_task;
-	printf("next task: %d\n", currTask);
-	
-	//Decreases semaphore if unblocked after waiting for semaphore to be available
-	if (TCBS[currTask].when_unblocked_decrease_semaphore != NULL)
-	{
-		(*TCBS[currTask].when_unblocked_decrease_semaphore).count--;
-		TCBS[currTask].when_unblocked_decrease_semaphore = NULL;
-	}
 	
 	//Removes next task's node
 	remove_front_node(TCBS[next_task].priority);
 	
-	//Reset PENDSVSET bit of ICSR to 0
-	SCB->ICSR &= !(1 << 28);
+	//PENDSVSET was cleared by hardware when PendSV was taken. Not cleared again here, so a pend from a handler that
+	//preempted this one still runs PendSV once more
 	
-	printf("\n\n=============PENDSV END===============\n\n");		
+	kernel_unlock(bench_mask_pendsv);
+#if PENDSV_TRACE
+	pendsv_trace(prev_task);
+#endif
 }
 
 //Function pointer to create task function
@@ -397,46 +2062,174 @@ typedef void(*rtosTaskFunc_t)(void *args);
 //Gets called in taks initialization and pre-emting
 void add_node(uint8_t priority_, uint8_t taskNum)
 {
-	//Iterate down linked list
-	Node_t* currNode = schedule_array[priority_];
+	Node_t* newNode = &TCBS[taskNum].node;
+	(*newNode).next = NULL;
 
-	//Case 1: if this priority's linked list is empty, just insert)
+	//Case 1: if this priority's linked list is empty, new node is both head and tail
 	if (schedule_array[priority_] == NULL)
-	{
-    Node_t* newNode = (Node_t*)malloc(sizeof(Node_t));
-    (*newNode).task_num = taskNum;
-    (*newNode).next = NULL;
 		schedule_array[priority_] = newNode;
-	}
-	//Case 2: if not empty
-  else
-  {
-		//Get to last node
-    while ((*currNode).next != NULL)
-      currNode = (*currNode).next;
-    
-    //Set last node pointer to pointer of new node, and set its members
-    Node_t* newNode = (Node_t*)malloc(sizeof(Node_t));
-    (*newNode).task_num = taskNum;
-    (*newNode).next = NULL;
-    (*currNode).next = newNode;
-  }
+	//Case 2: if not empty, append after tail pointer instead of walking to last node
+	else
+		(*schedule_tail[priority_]).next = newNode;
+
+	schedule_tail[priority_] = newNode;
+	ready_bitmap |= (1u << priority_);
+}
+
+//Readies a blocked task. A task that blocked but has not been switched out yet, e.g. woken by an interrupt
+//handler before PendSV ran, is still current and is put back on its ready list by PendSV_Handler instead;
+//adding it here too would link its node to itself
+void make_ready(uint8_t taskNum)
+{
+	TCBS[taskNum].status = task_ready;
+	if (taskNum != currTask)
+		add_node(TCBS[taskNum].priority, taskNum);
+}
+
+//Inserts an existing node at front of a priority list, used when a task must run before others of that priority
+void add_node_front(uint8_t priority, Node_t *node)
+{
+	(*node).next = schedule_array[priority];
+	if (schedule_array[priority] == NULL)
+		schedule_tail[priority] = node;
+	schedule_array[priority] = node;
+	ready_bitmap |= (1u << priority);
 }
 
-void task_create(rtosTaskFunc_t taskFunction, void *R0, uint8_t priority_)
+//Changes a task's effective priority. A task waiting to run is moved to the new priority's ready list,
+//in front if it was raised so it runs before others of that priority
+void set_priority(uint8_t taskNum, uint8_t priority)
 {
-	//Protects against more than 6 tasks being created
-	if (numTasks > 5)
+	uint8_t old_priority = TCBS[taskNum].priority;
+	TCBS[taskNum].priority = priority;
+	
+	//Boosted or dropped while waiting on a priority ordered semaphore, so it moves to its new place in line
+	if (TCBS[taskNum].status == task_blocked_semaphore && (*TCBS[taskNum].blocked_on_sem).priority_ordered
+		&& old_priority != priority)
+	{
+		sem_wait_remove(TCBS[taskNum].blocked_on_sem, taskNum);
+		sem_wait_insert(TCBS[taskNum].blocked_on_sem, taskNum);
+		return;
+	}
+	if ((TCBS[taskNum].status == task_blocked_queue || TCBS[taskNum].status == task_blocked_event)
+		&& old_priority != priority)
+	{
+		wait_list_remove(TCBS[taskNum].blocked_on_list, taskNum);
+		wait_list_insert(TCBS[taskNum].blocked_on_list, taskNum);
+		return;
+	}
+	
+	//Running task and blocked tasks are not in a ready list
+	if (taskNum == currTask || TCBS[taskNum].status != task_ready || old_priority == priority)
+		return;
+	
+	Node_t *target = unlink_node(old_priority, taskNum);
+	if (target == NULL)
 		return;
+	if (priority > old_priority)
+		add_node_front(priority, target);
+	else
+		add_node(priority, taskNum);
+}
+
+//Inserts task's node into a wait list kept highest priority first, equal priorities stay first come first served
+void wait_list_insert(Node_t **head, uint8_t taskNum)
+{
+	Node_t *newNode = &TCBS[taskNum].node;
+	
+	while (*head != NULL && TCBS[(**head).task_num].priority >= TCBS[taskNum].priority)
+		head = &(**head).next;
+	
+	(*newNode).next = *head;
+	*head = newNode;
+}
+
+//Removes task's node from a wait list, returns false if it was not in the list
+bool wait_list_remove(Node_t **head, uint8_t taskNum)
+{
+	while (*head != NULL && (**head).task_num != taskNum)
+		head = &(**head).next;
+	if (*head == NULL)
+		return false;
+	
+	*head = (**head).next;
+	TCBS[taskNum].node.next = NULL;
+	return true;
+}
+
+//Unlinks task's node from a priority list without freeing it, returns NULL if task is not in that list
+Node_t *unlink_node(uint8_t priority, uint8_t taskNum)
+{
+	Node_t *beforeTarget = NULL;
+	Node_t *target = schedule_array[priority];
+
+	while (target != NULL && (*target).task_num != taskNum)
+	{
+		beforeTarget = target;
+		target = (*target).next;
+	}
+	if (target == NULL)
+		return NULL;
+
+	if (beforeTarget == NULL)//Target at beginning
+		schedule_array[priority] = (*target).next;
+	else
+		(*beforeTarget).next = (*target).next;
+
+	if (schedule_tail[priority] == target)//Target at end
+		schedule_tail[priority] = beforeTarget;
+	if (schedule_array[priority] == NULL)
+		ready_bitmap &= ~(1u << priority);
+
+	(*target).next = NULL;
+	return target;
+}
+
+//Takes stack_size bytes from the stack region, returns lowest word of the new stack or NULL if region is full
+uint32_t *stack_alloc(uint32_t stack_size)
+{
+	//Whole double words so every stack keeps the 8 byte alignment the exception frame needs
+	uint32_t words = ((stack_size + 7) / 8) * 2;
+	if (words > stack_region_free)
+		return NULL;
+	
+	stack_region_free -= words;
+	return &stack_region[stack_region_free];
+}
+
+//Fills stack words from limit up to but not including top with STACK_FILL_PATTERN
+void stack_paint(uint32_t *limit, uint32_t *top)
+{
+	while (limit < top)
+		*limit++ = STACK_FILL_PATTERN;
+}
+
+//Creates a task on a caller supplied, 8 byte aligned stack. Returns new task number, 99 if task could not be created
+uint8_t task_create_with_stack(rtosTaskFunc_t taskFunction, void *R0, uint8_t priority_, uint32_t *stack, uint32_t stack_size)
+{
+	//Exception frame is only aligned if stack starts and ends on a double word
+	stack_size &= ~7u;
+	
+	//Protects against more than MAX_TASKS tasks being created, a priority with no ready list or an unusable stack
+	if (numTasks >= MAX_TASKS || priority_ >= NUM_PRIORITIES)
+		return 99;
+	if (stack == NULL || ((uint32_t)stack & 7) || stack_size < MIN_STACK_SIZE)
+		return 99;
 	
 	add_node(priority_, numTasks);
 		
 	//Initialize TCB members
+	TCBS[numTasks].stack_limit = stack;
+	TCBS[numTasks].stack_size = stack_size;
+	TCBS[numTasks].base = stack + stack_size/4 - 1;
 	TCBS[numTasks].stack_pointer = TCBS[numTasks].base - 15;
+	TCBS[numTasks].stack_low_water = TCBS[numTasks].stack_pointer;
+	stack_paint(stack, TCBS[numTasks].stack_pointer);
 	TCBS[numTasks].priority = priority_;
+	TCBS[numTasks].base_priority = priority_;
 	TCBS[numTasks].status = task_ready;
-	TCBS[numTasks].timeslices_since_blocked = 0;
-	TCBS[numTasks].timeslices_to_be_blocked = 0;
+	TCBS[numTasks].delay_delta = 0;
+	TCBS[numTasks].delay_next = 99;
 	
 	//Setting R0
 	*(TCBS[numTasks].base - 7) = (uint32_t)R0;
@@ -447,6 +2240,70 @@ void task_create(rtosTaskFunc_t taskFunction, void *R0, uint8_t priority_)
 
   numTasks++;
 	createdTasks++;
+	return numTasks - 1;
+}
+
+//Creates a task with a stack_size byte stack from the stack region, 0 for DEFAULT_STACK_SIZE. Returns new task number, 99 on failure
+uint8_t task_create(rtosTaskFunc_t taskFunction, void *R0, uint8_t priority_, uint32_t stack_size)
+{
+	if (stack_size == 0)
+		stack_size = DEFAULT_STACK_SIZE;
+	stack_size = (stack_size + 7) & ~7u;
+	
+	//Check before taking any stack so a rejected task does not use up the region
+	if (numTasks >= MAX_TASKS || priority_ >= NUM_PRIORITIES || stack_size < MIN_STACK_SIZE)
+		return 99;
+	
+	uint32_t *stack = stack_alloc(stack_size);
+	if (stack == NULL)
+	{
+		printf("Stack region full, cannot create task with %d byte stack\n", stack_size);
+		return 99;
+	}
+	return task_create_with_stack(taskFunction, R0, priority_, stack, stack_size);
+}
+
+//Returns the most stack bytes the task has used so far. Scans up from the stack limit for the lowest word that
+//no longer holds the fill pattern, stopping at the low water mark of the previous call, so the cost is the
+//number of words never used. Exact even when a frame left words unwritten, e.g. an uninitialised local array
+uint32_t stack_high_water(uint8_t taskNum)
+{
+	uint32_t *probe = TCBS[taskNum].stack_limit;
+	
+	while (probe < TCBS[taskNum].stack_low_water && *probe == STACK_FILL_PATTERN)
+		probe++;
+	
+	TCBS[taskNum].stack_low_water = probe;
+	return (uint32_t)(TCBS[taskNum].base + 1 - probe) * 4;
+}
+
+#if STACK_CHECK
+uint32_t last_stack_check;
+
+//Called from idle task, reports every task that has come within STACK_WARN_BYTES of overflowing its stack
+void stack_check(void)
+{
+	if (msTicks - last_stack_check < STACK_CHECK_PERIOD_MS)
+		return;
+	last_stack_check = msTicks;
+	
+	for (int i=0; i<createdTasks; i++)
+	{
+		uint32_t used = stack_high_water(i);
+		if (TCBS[i].stack_size - used < STACK_WARN_BYTES)
+			printf("STACK WARNING: task %d has used %d of %d stack bytes\n", i, used, TCBS[i].stack_size);
+	}
+}
+#endif
+
+//Prints where the kernel's RAM goes and how much of each stack has been used, so stack sizes can be trimmed
+void print_ram_report(void)
+{
+	printf("RAM: %d bytes of TCBs for %d tasks\n", (int)sizeof(TCBS), MAX_TASKS);
+	for (int i=0; i<createdTasks; i++)
+		printf("RAM: task %d stack %d bytes at 0x%08x, %d used at most\n", i, TCBS[i].stack_size, (uint32_t)TCBS[i].stack_limit, stack_high_water(i));
+	printf("RAM: stack region %d of %d bytes used, %d free\n", STACK_REGION_SIZE - stack_region_free*4, STACK_REGION_SIZE, stack_region_free*4);
+	heap_print_stats();
 }
 
 //Returns task number of task removed, 0 if no ready tasks at priority, -1 if invalid priority
@@ -454,7 +2311,7 @@ uint8_t remove_front_node(uint8_t priority)
 {
   uint8_t taskNumOfRemoved = 0;
 
-  if (priority > 5)
+  if (priority >= NUM_PRIORITIES)
     return 99;
 
   if (schedule_array[priority] == NULL)
@@ -463,28 +2320,33 @@ uint8_t remove_front_node(uint8_t priority)
   taskNumOfRemoved = (*schedule_array[priority]).task_num;
 
   Node_t* secondNode = (*schedule_array[priority]).next;
-  free(schedule_array[priority]);
+  (*schedule_array[priority]).next = NULL;
   schedule_array[priority] = secondNode;
 
+  //Last node removed, clear tail and this priority's ready bit
+  if (secondNode == NULL)
+  {
+    schedule_tail[priority] = NULL;
+    ready_bitmap &= ~(1u << priority);
+  }
+
   return (uint8_t)taskNumOfRemoved;
 }
 
 //Return -1 if no available next task
 uint8_t find_next_task()
 {
-  //Iterate down bit vector until find next available priority
-  int next_priority = 5;
-  while (schedule_array[next_priority] == NULL && next_priority >= 0) {
-    next_priority--;
-  }
-  
   //If no available next task
-  if (next_priority == -1)
+  if (ready_bitmap == 0)
 	{
 		printf("No available next task, ERROR");
     return 99;
 	}
 
+  //Highest set bit of ready bitmap is highest ready priority, found with one count leading zeros instruction
+  //so the cost does not depend on number of priorities or tasks
+  uint8_t next_priority = 31 - __CLZ(ready_bitmap);
+
   //If available next task, return first task num of linked list.
   //Because available tasks are added at back of linked list
   //and ready tasks are removed at front of linked list,
@@ -501,31 +2363,45 @@ void initialization(void) {
 	//This used to remember where main stack base is
 	uint32_t *mainstack_base = *mainstack;
 	
-	TCBS[5].base = (uint32_t *)(mainstack_address - 0x0800/4);
-	TCBS[4].base = (uint32_t *)(mainstack_address - 0x1200/4);
-	TCBS[3].base = (uint32_t *)(mainstack_address - 0x1600/4);
-	TCBS[2].base = (uint32_t *)(mainstack_address - 0x2000/4);
-	TCBS[1].base = (uint32_t *)(mainstack_address - 0x2400/4);
-	TCBS[0].base = (uint32_t *)(mainstack_address - 0x2800/4);
+	//Idle task gets the first stack from the stack region, base is its highest word
+	TCBS[0].stack_limit = stack_alloc(IDLE_STACK_SIZE);
+	TCBS[0].stack_size = IDLE_STACK_SIZE;
+	TCBS[0].base = TCBS[0].stack_limit + IDLE_STACK_SIZE/4 - 1;
 	
 	numTasks = 0;
 	
 	//Initialize schedule array to all point to NULL. Will be populated by task create function.
-	for (int i=0; i<6; i++)
+	for (int i=0; i<NUM_PRIORITIES; i++)
+	{
 		schedule_array[i] = NULL;
+		schedule_tail[i] = NULL;
+	}
+	ready_bitmap = 0;
+	delay_head = 99;
+	scheduler_lock_count = 0;
+	switch_deferred = false;
 		
-	for (int i=0; i<6; i++)
+	for (int i=0; i<MAX_TASKS; i++)
 	{
-		TCBS[i].when_unblocked_decrease_semaphore = NULL;
-		TCBS[i].temporary_promotion = false;
-		TCBS[i].add_in_different_priority = false;
-		TCBS[i].different_priority = 99;
+		TCBS[i].blocked_on_sem = NULL;
+		TCBS[i].critical_nesting = 0;
+		TCBS[i].blocked_on_list = NULL;
+		TCBS[i].notify_value = 0;
+		TCBS[i].notify_pending = false;
+		TCBS[i].delay_next = 99;
+		TCBS[i].delay_prev = 99;
+		TCBS[i].delayed = false;
+		TCBS[i].node.task_num = i;
+		TCBS[i].node.next = NULL;
+		TCBS[i].held_mutexes = NULL;
+		TCBS[i].blocked_on_mutex = NULL;
 	}
 	
 	// Copy the main stack contents to process stack of new main() task and set the MSP to the main stack base address
-	// Loop through each item and then save to next stack from mainstack_address - 0x8000
+	// Loop through each item and then save to idle task's stack
 	uint32_t *MSP = (uint32_t *)__get_MSP();
 	TCBS[0].current = TCBS[0].base;
+	stack_paint(TCBS[0].stack_limit, TCBS[0].base + 1);
 	
 	//Copy everything in main stack to task 1 stack
 	while (mainstack_address >= MSP) {
@@ -535,6 +2411,7 @@ void initialization(void) {
 	}
 	
 	TCBS[0].stack_pointer = TCBS[0].current + 1;
+	TCBS[0].stack_low_water = TCBS[0].stack_pointer;
 	
 	//Set MSP to mainstack base address
 	__set_MSP((uint32_t)mainstack_base);
@@ -550,15 +2427,18 @@ void initialization(void) {
 	
 	//Set task 1 priority to 0, acts as idle task
 	TCBS[0].priority = 0;
+	TCBS[0].base_priority = 0;
 	
 	//Set task 1 status to ready
 	TCBS[0].status = task_ready;
-	TCBS[0].timeslices_since_blocked = 0;
-	TCBS[0].timeslices_to_be_blocked = 0;
+	TCBS[0].delay_delta = 0;
+	TCBS[0].delay_next = 99;
 	
 	//Increment numtasks now that there is a task
 	numTasks++;
 	createdTasks++;
+	
+	heap_init();
 }
 
 
@@ -597,6 +2477,125 @@ void second_task(void *args) {
 	}
 }
 
+#if RTOS_BENCHMARK
+//A benchmark task that has finished blocks for good, so it never disturbs the lower priority benchmarks after it
+void bench_park(void) {
+	while (1)
+		notify_wait(wait_forever, NULL);
+}
+
+//Queue benchmark messages are 4 words, through a queue of 8
+#define QUEUE_BENCH_WORDS 4
+#define QUEUE_BENCH_CAPACITY 8
+queue_t bench_queue;
+uint32_t bench_queue_storage[QUEUE_BENCH_WORDS * QUEUE_BENCH_CAPACITY];
+
+void queue_bench_producer(void *args) {
+	uint32_t message[QUEUE_BENCH_WORDS] = {0};
+	
+	for (uint32_t i=0; i<QUEUE_BENCH_MESSAGES/2; i++)
+	{
+		message[0] = i;
+		queue_send(&bench_queue, message, wait_forever);
+	}
+	//Same again, built straight in queue storage
+	for (uint32_t i=QUEUE_BENCH_MESSAGES/2; i<QUEUE_BENCH_MESSAGES; i++)
+	{
+		uint32_t *slot = (uint32_t *)queue_reserve(&bench_queue, wait_forever);
+		slot[0] = i;
+		for (int j=1; j<QUEUE_BENCH_WORDS; j++)
+			slot[j] = 0;
+		queue_commit(&bench_queue);
+	}
+	
+	bench_park();
+}
+
+//Higher priority than the producer, so it runs first, starts the clock and then takes each message as it is sent
+void queue_bench_consumer(void *args) {
+	uint32_t message[QUEUE_BENCH_WORDS];
+	uint32_t start = DWT->CYCCNT;
+	
+	for (uint32_t i=0; i<QUEUE_BENCH_MESSAGES; i++)
+		queue_receive(&bench_queue, message, wait_forever);
+	queue_bench_cycles = DWT->CYCCNT - start;
+	
+	bench_park();
+}
+
+sem_t bench_wake_sem;
+uint8_t bench_pong_task;
+
+//Woken WAKE_BENCH_ROUNDS times through a semaphore, then as many through notify. wait_timeout and notify_wait
+//record the cycles from each wake-up to this task running in bench_signal_wake and bench_notify_wake
+void wake_bench_pong(void *args) {
+	for (uint32_t i=0; i<WAKE_BENCH_ROUNDS; i++)
+		wait(&bench_wake_sem);
+	for (uint32_t i=0; i<WAKE_BENCH_ROUNDS; i++)
+		notify_wait(wait_forever, NULL);
+	
+	bench_park();
+}
+
+//Lower priority than pong, so it only runs once pong is blocked and every wake-up switches straight to pong
+void wake_bench_ping(void *args) {
+	for (uint32_t i=0; i<WAKE_BENCH_ROUNDS; i++)
+		signal(&bench_wake_sem);
+	for (uint32_t i=0; i<WAKE_BENCH_ROUNDS; i++)
+		notify(bench_pong_task, 0, notify_signal);
+	
+	bench_park();
+}
+
+//Mutex contention: low takes mutex_lock and then readies high, which wants it, and medium, which does not.
+//With inheritance high blocks and low runs at high's priority until it releases, with a ceiling low is already
+//at the ceiling so high only runs once the mutex is free. Lowest priority benchmark, runs once the others are done
+sem_t bench_high_sem;
+sem_t bench_medium_sem;
+
+//Busy loop standing in for work done by the contention tasks
+void bench_work(uint32_t loops) {
+	for (volatile uint32_t i=0; i<loops; i++);
+}
+
+void mutex_bench_low(void *args) {
+	uint32_t switches = context_switches;
+	
+	for (uint32_t i=0; i<MUTEX_BENCH_ROUNDS; i++)
+	{
+		mutex_acquire(&mutex_lock);
+		signal(&bench_high_sem);
+		signal(&bench_medium_sem);
+		bench_work(1000);
+		mutex_release(&mutex_lock);
+	}
+	mutex_bench_switches = context_switches - switches;
+	mutex_bench_done = true;
+	
+	bench_park();
+}
+
+void mutex_bench_medium(void *args) {
+	for (uint32_t i=0; i<MUTEX_BENCH_ROUNDS; i++)
+	{
+		wait(&bench_medium_sem);
+		bench_work(1000);
+	}
+	bench_park();
+}
+
+void mutex_bench_high(void *args) {
+	for (uint32_t i=0; i<MUTEX_BENCH_ROUNDS; i++)
+	{
+		wait(&bench_high_sem);
+		mutex_acquire(&mutex_lock);
+		bench_work(100);
+		mutex_release(&mutex_lock);
+	}
+	bench_park();
+}
+#endif
+
 int main(void) {
 	printf("\n   _____  ____  _               _____  _____  _____   _____ _______ ____   _____ \n");
 	printf("  / ____|/ __ \| |        /\   |  __ \|_   _|/ ____| |  __ \__   __/ __ \ / ____|\n");
@@ -608,19 +2607,58 @@ int main(void) {
 	//Initialization creates task 0
 	initialization();
 	
+#if USE_CEILING_MUTEX
+	//Ceiling is the highest priority of the tasks that use the mutex, the demo's first task or the high contention task
+	mutex_init_ceiling(&mutex_lock, RTOS_BENCHMARK ? 3 : 5);
+#else
 	mutex_init(&mutex_lock, 1);
+#endif
 	semaphore_init(&lock1, 0);
 	
+#if RTOS_BENCHMARK
+	//Benchmark tasks replace the demo, whose first task never blocks once it owns the mutex and would starve them
+	queue_init(&bench_queue, bench_queue_storage, QUEUE_BENCH_WORDS * 4, QUEUE_BENCH_CAPACITY);
+	rtosTaskFunc_t consumer = &queue_bench_consumer;
+	task_create(consumer, NULL, 3, 0x400);
+	rtosTaskFunc_t producer = &queue_bench_producer;
+	task_create(producer, NULL, 2, 0x400);
+	//Above the queue pair, so the wake-up comparison runs first without them in between
+	semaphore_init(&bench_wake_sem, 0);
+	rtosTaskFunc_t pong = &wake_bench_pong;
+	bench_pong_task = task_create(pong, NULL, 5, 0x400);
+	rtosTaskFunc_t ping = &wake_bench_ping;
+	task_create(ping, NULL, 4, 0x400);
+	//Below everything else, low only starts once the other benchmark tasks are parked
+	semaphore_init(&bench_high_sem, 0);
+	semaphore_init(&bench_medium_sem, 0);
+	rtosTaskFunc_t high = &mutex_bench_high;
+	task_create(high, NULL, 3, 0x300);
+	rtosTaskFunc_t medium = &mutex_bench_medium;
+	task_create(medium, NULL, 2, 0x300);
+	rtosTaskFunc_t low = &mutex_bench_low;
+	task_create(low, NULL, 1, 0x300);
+#else
 	rtosTaskFunc_t task1 = &first_task;
-	task_create(task1, NULL, 5);
+	task_create(task1, NULL, 5, 0x400);
 	rtosTaskFunc_t task2 = &second_task;
-	task_create(task2, NULL, 1);
+	task_create(task2, NULL, 1, 0x400);
+#endif
+	
+	print_ram_report();
  
+#if RTOS_BENCHMARK
+	benchmark_init();
+	//Runs before the scheduler starts, so only the allocator itself is timed
+	heap_benchmark(1000);
+#endif
+	//PendSV on the lowest priority so a context switch never delays another interrupt. SysTick_Config puts SysTick
+	//there too, which is at or below KERNEL_INTERRUPT_PRIORITY so its handler is covered by kernel critical sections
+	NVIC_SetPriority(PendSV_IRQn, (1 << __NVIC_PRIO_BITS) - 1);
 	SysTick_Config(SystemCoreClock/(1000));
 	
 	while(true) {
 		printf("\n\n=========================================TASK 0, IDLE TASK====================================\n\n");
-		for (int priority = 0; priority<6; priority++)
+		for (int priority = 0; priority<NUM_PRIORITIES; priority++)
 		{
 			Node_t *currNode = schedule_array[priority];
 			printf("\t\t\t\tPriority list %d:", priority);
@@ -633,5 +2671,15 @@ int main(void) {
 			printf("\n");
 		}
 		printf("\n");
+#if RTOS_BENCHMARK
+		benchmark_report();
+#endif
+#if STACK_CHECK
+		stack_check();
+#endif
+#if TICKLESS_IDLE
+		printf("msTicks: %d, SysTick interrupts: %d\n", msTicks, systick_interrupts);
+		tickless_idle();
+#endif
 	}
 }